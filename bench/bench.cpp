@@ -0,0 +1,616 @@
+// Host benchmark and fuzz driver for the serial parsers and the telemetry
+// serializers, built by [env:native]:
+//
+//   pio run -e native && .pio/build/native/program [corpus [stream corpus]]
+//
+// Prints one line per benchmark and exits non-zero when a hot path starts
+// allocating, a message outgrows its bound, a malformed line is accepted or
+// the receiver fails to resynchronise, so CI can gate on it.
+
+#include <adaptive_rate.h>
+#include <config.h>
+#include <device_config.h>
+#include <processing_functions.h>
+#include <serial_protocol.h>
+#include <telemetry.h>
+
+#include <chrono>
+#include <new>
+
+#define BENCH_DEFAULT_CORPUS "bench/corpus/malformed_lines.txt"
+#define BENCH_DEFAULT_STREAM_CORPUS "bench/corpus/mixed_stream.txt"
+#define BENCH_ITERATIONS 200000
+#define BENCH_STREAM_FRAMES 20000
+#define BENCH_FUZZ_ROUNDS 100000
+#define BENCH_BATCH_SAMPLES 8
+
+static const char reference_line[] = "2,2,1,-2.50,45,7,800,2,2.10,50,8,900,1,50,1200,1,60,1300,1,0,1,99";
+
+// Every channel present, built by buildFullLine()
+static char full_line[SERIAL_FRAME_MAX_LENGTH];
+
+static unsigned long allocation_count = 0;
+static int failures = 0;
+
+void *operator new(size_t size) {
+  allocation_count++;
+  void *p = malloc(size ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+static void fail(const char *what) {
+  printf("FAIL %s\n", what);
+  failures++;
+}
+
+static uint32_t xorshift_state = 0x2545F491;
+
+static uint32_t nextRandom() {
+  xorshift_state ^= xorshift_state << 13;
+  xorshift_state ^= xorshift_state >> 17;
+  xorshift_state ^= xorshift_state << 5;
+  return xorshift_state;
+}
+
+typedef struct {
+  std::chrono::steady_clock::time_point start;
+  unsigned long allocations;
+} bench_timer;
+
+static bench_timer benchStart() {
+  bench_timer timer = {std::chrono::steady_clock::now(), allocation_count};
+  return timer;
+}
+
+// Reports rate and allocations per item; allocations in a hot path fail the run
+static void benchReport(const char *name, const bench_timer *timer, unsigned long items, size_t bytes_per_item) {
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - timer->start).count();
+  unsigned long allocations = allocation_count - timer->allocations;
+
+  printf("%-22s %12.0f items/s %9.1f ns/item %6.2f allocs/item", name, items / seconds,
+         seconds * 1e9 / items, (double)allocations / items);
+  if (bytes_per_item > 0) {
+    printf(" %6lu bytes/item", (unsigned long)bytes_per_item);
+  }
+  printf("\n");
+
+  if (allocations != 0) {
+    fail(name);
+  }
+}
+
+static void buildFullLine() {
+  int length = snprintf(full_line, sizeof(full_line), "%d,%d", PAYLOAD_MAX_SENSORS, PAYLOAD_MAX_FANS);
+  for (int i = 0; i < PAYLOAD_MAX_SENSORS; i++) {
+    length += snprintf(full_line + length, sizeof(full_line) - length, ",1,-2.%02d,45,7,%d", 50 - i, 800 + i);
+  }
+  for (int i = 0; i < PAYLOAD_MAX_FANS; i++) {
+    length += snprintf(full_line + length, sizeof(full_line) - length, ",1,50,%d", 1200 + i);
+  }
+  snprintf(full_line + length, sizeof(full_line) - length, ",1,0,1,99");
+}
+
+static void benchAsciiParse(const char *name, const char *line) {
+  payload_structure payload = {};
+  size_t length = strlen(line);
+
+  bench_timer timer = benchStart();
+  for (unsigned long i = 0; i < BENCH_ITERATIONS; i++) {
+    if (processData(line, length, &payload) != FRAME_PARSE_OK) {
+      fail("ascii reference frame rejected");
+      return;
+    }
+  }
+  benchReport(name, &timer, BENCH_ITERATIONS, length + 1);
+}
+
+static void benchBinaryParse(const char *name, const char *line) {
+  payload_structure payload = {};
+  payload_structure decoded = {};
+  uint8_t frame[SERIAL_FRAME_MAX_LENGTH];
+  uint8_t work[SERIAL_FRAME_MAX_LENGTH];
+
+  processData(line, strlen(line), &payload);
+  size_t length = encodeBinaryFrame(&payload, frame, sizeof(frame));
+
+  bench_timer timer = benchStart();
+  for (unsigned long i = 0; i < BENCH_ITERATIONS; i++) {
+    memcpy(work, frame, length - 1);  // decoding is in place
+    if (processBinaryData(work, length - 1, &decoded) != FRAME_PARSE_OK) {
+      fail("binary reference frame rejected");
+      return;
+    }
+  }
+  benchReport(name, &timer, BENCH_ITERATIONS, length);
+
+  if (memcmp(&payload, &decoded, sizeof(payload)) != 0) {
+    fail("binary frame does not round trip");
+  }
+}
+
+// End to end through the frame receiver, as fed by the sensor MCU
+static void benchStream() {
+  static payload_buffer buffer = {};
+  std::string line = std::string(reference_line) + "\r\n";
+
+  for (unsigned long i = 0; i < BENCH_STREAM_FRAMES; i++) {
+    Serial.feed(line.c_str());
+  }
+
+  uint32_t frames_before = serial_rx_get_stats()->frames_ok;
+  bench_timer timer = benchStart();
+  while (Serial.available() > 0) {
+    read_serial_port(&buffer);
+  }
+  benchReport("read_serial_port", &timer, BENCH_STREAM_FRAMES, line.size());
+
+  if (serial_rx_get_stats()->frames_ok - frames_before != BENCH_STREAM_FRAMES) {
+    fail("stream frames lost");
+  }
+}
+
+static uint16_t sample_frame_count = 1;
+
+// Reference samples; with more than one frame per window the measurements
+// get a spread so their min and max are written too.
+static bool benchSampleSource(size_t index, telemetry_sample *sample) {
+  sample->timestamp = 1700000000 + (uint32_t)index;
+  sample->frame_count = sample_frame_count;
+  processData(reference_line, strlen(reference_line), &sample->payload);
+  sample->payload_min = sample->payload;
+  sample->payload_max = sample->payload;
+  if (sample_frame_count > 1) {
+    sample->payload_min.sensors[0].CO2 -= 40;
+    sample->payload_max.sensors[0].CO2 += 40;
+  }
+  return index < BENCH_BATCH_SAMPLES;
+}
+
+// Stands in for the MQTT connection
+static size_t sink_bytes = 0;
+
+static bool benchSink(const uint8_t *, size_t length) {
+  sink_bytes += length;
+  return true;
+}
+
+// Keeps the message for inspection
+static char json[TELEMETRY_SAMPLE_MAX_LENGTH + 1];
+static size_t json_length = 0;
+
+static bool benchJsonSink(const uint8_t *data, size_t length) {
+  if (json_length + length >= sizeof(json)) {
+    return false;
+  }
+  memcpy(json + json_length, data, length);
+  json_length += length;
+  return true;
+}
+
+// The message as published: a measuring pass, then the streaming pass
+static void benchSerializeBatch(const char *name, size_t max_samples, uint16_t frame_count) {
+  telemetry_delta_state delta;
+  size_t length = 0;
+  size_t written = 0;
+
+  sample_frame_count = frame_count;
+  bench_timer timer = benchStart();
+  for (unsigned long i = 0; i < BENCH_ITERATIONS / 10; i++) {
+    telemetry_delta_reset(&delta);
+    telemetry_stream_batch(benchSampleSource, max_samples, i, &delta, NULL, &length);
+    telemetry_delta_reset(&delta);
+    sink_bytes = 0;
+    telemetry_stream_batch(benchSampleSource, max_samples, i, &delta, benchSink, &written);
+  }
+  benchReport(name, &timer, BENCH_ITERATIONS / 10, length);
+
+  if (length > max_samples * (TELEMETRY_SAMPLE_MAX_LENGTH + 1) + 2) {
+    fail("telemetry message exceeds its bound");
+  }
+  if (written != length || sink_bytes != length) {
+    fail("streamed length differs from the measured one");
+  }
+}
+
+// Keeps a packed message for decoding
+static uint8_t packed[BENCH_BATCH_SAMPLES * PAYLOAD_MAX_FIELD_COUNT * 15 + 16];
+static size_t packed_length = 0;
+
+static bool benchPackedSink(const uint8_t *data, size_t length) {
+  if (packed_length + length > sizeof(packed)) {
+    return false;
+  }
+  memcpy(packed + packed_length, data, length);
+  packed_length += length;
+  return true;
+}
+
+static uint32_t readVarint(size_t *offset) {
+  uint32_t value = 0;
+  for (int shift = 0; *offset < packed_length && shift < 35; shift += 7) {
+    uint8_t byte = packed[(*offset)++];
+    value |= (uint32_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+static int32_t readZigzag(size_t *offset) {
+  uint32_t value = readVarint(offset);
+  return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+// Decodes the packed message the way the cloud side does and compares it
+// with the samples it was made from
+static bool checkPackedRoundTrip(size_t samples) {
+  payload_structure previous = {};
+  telemetry_sample expected;
+  uint32_t timestamp = 0;
+  size_t offset = 0;
+  payload_cursor cursor;
+
+  if (packed_length < 2 || packed[offset++] != TELEMETRY_PACKED_VERSION || readVarint(&offset) != 7) {
+    return false;
+  }
+  for (size_t i = 0; i < samples; i++) {
+    payload_structure decoded = {};
+    benchSampleSource(i, &expected);
+    timestamp += readZigzag(&offset);
+    uint32_t frames = readVarint(&offset);
+    if (offset + 2 > packed_length || timestamp != expected.timestamp || frames != expected.frame_count
+        || !payload_set_channels(&decoded, packed[offset], packed[offset + 1])) {
+      return false;
+    }
+    offset += 2;
+    bool absolute = i == 0 || !payload_same_channels(&decoded, &previous);
+    for (bool more = payload_begin(&decoded, &cursor); more; more = payload_next(&decoded, &cursor)) {
+      int32_t value = readZigzag(&offset) + (absolute ? 0 : payload_get(&previous, &cursor));
+      payload_set(&decoded, &cursor, value);
+      if (value != payload_get(&expected.payload, &cursor)) {
+        return false;
+      }
+      if (frames > 1 && PAYLOAD_KIND_IS_MEASUREMENT(payload_field(&cursor)->kind)
+          && (readZigzag(&offset) + value != payload_get(&expected.payload_min, &cursor)
+              || readZigzag(&offset) + value != payload_get(&expected.payload_max, &cursor))) {
+        return false;
+      }
+    }
+    previous = decoded;
+  }
+  return offset == packed_length;
+}
+
+// The packed batch encoding: must be lossless and smaller than the JSON
+// batch of the same samples
+static void benchSerializePacked(const char *name, uint16_t frame_count) {
+  telemetry_delta_state delta;
+  size_t json_batch_length = 0;
+  size_t length = 0;
+
+  sample_frame_count = frame_count;
+  telemetry_delta_reset(&delta);
+  telemetry_stream_batch(benchSampleSource, BENCH_BATCH_SAMPLES, 7, &delta, NULL, &json_batch_length);
+
+  bench_timer timer = benchStart();
+  for (unsigned long i = 0; i < BENCH_ITERATIONS / 10; i++) {
+    telemetry_stream_packed(benchSampleSource, BENCH_BATCH_SAMPLES, i, NULL, &length);
+    sink_bytes = 0;
+    telemetry_stream_packed(benchSampleSource, BENCH_BATCH_SAMPLES, i, benchSink, &length);
+  }
+  benchReport(name, &timer, BENCH_ITERATIONS / 10, length);
+  if (sink_bytes != length) {
+    fail("streamed length differs from the measured one");
+  }
+
+  packed_length = 0;
+  size_t count = telemetry_stream_packed(benchSampleSource, BENCH_BATCH_SAMPLES, 7, benchPackedSink, &length);
+  if (count != BENCH_BATCH_SAMPLES || packed_length != length) {
+    fail("packed stream incomplete");
+  } else if (!checkPackedRoundTrip(count)) {
+    fail("packed batch does not decode to its samples");
+  }
+  if (length * 2 > json_batch_length) {
+    fail("packed batch not below half the JSON size");
+  }
+}
+
+// Samples where only one field moves past its deadband, with keyframes
+// far apart
+static bool benchDeltaSource(size_t index, telemetry_sample *sample) {
+  static int16_t temperature = 0;
+
+  benchSampleSource(index, sample);
+  temperature = temperature > 100 ? 0 : temperature + 10;
+  sample->payload.sensors[0].temperature = temperature;
+  return index == 0;
+}
+
+static void benchSerializeDelta() {
+  telemetry_delta_state delta;
+  size_t length = 0;
+
+  sample_frame_count = 1;
+  telemetry_delta_configure(UINT32_MAX, TELEMETRY_DEADBAND_TEMPERATURE, TELEMETRY_DEADBAND_HUMIDITY,
+                            TELEMETRY_DEADBAND_CO2);
+  telemetry_delta_reset(&delta);
+  telemetry_stream_batch(benchDeltaSource, 1, 0, &delta, NULL, &length);
+
+  bench_timer timer = benchStart();
+  for (unsigned long i = 0; i < BENCH_ITERATIONS; i++) {
+    telemetry_stream_batch(benchDeltaSource, 1, i, &delta, benchSink, &length);
+  }
+  benchReport("serialize delta", &timer, BENCH_ITERATIONS, length);
+
+  telemetry_delta_configure(TELEMETRY_KEYFRAME_INTERVAL, TELEMETRY_DEADBAND_TEMPERATURE, TELEMETRY_DEADBAND_HUMIDITY,
+                            TELEMETRY_DEADBAND_CO2);
+}
+
+// Every corpus line must be rejected and leave the payload untouched
+static void checkCorpus(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fail("corpus not found");
+    return;
+  }
+
+  payload_structure payload = {};
+  char line[512];
+  unsigned long lines = 0;
+
+  processData(reference_line, strlen(reference_line), &payload);
+  while (fgets(line, sizeof(line), file) != NULL) {
+    size_t length = strcspn(line, "\n");
+    if (line[0] == '#' || length == 0) {
+      continue;
+    }
+
+    payload_structure before = payload;
+    if (processData(line, length, &payload) == FRAME_PARSE_OK || memcmp(&before, &payload, sizeof(payload)) != 0) {
+      printf("accepted: %.*s\n", (int)length, line);
+      fail("corpus line accepted");
+    }
+    lines++;
+  }
+  fclose(file);
+  printf("%-22s %12lu lines rejected\n", "corpus", lines);
+}
+
+// Feeds the stream corpus to the receiver; whatever binary and ASCII comes
+// before, it has to end up accepting the reference frame at the end.
+static void checkStream(const char *path) {
+  static payload_buffer buffer = {};
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    fail("stream corpus not found");
+    return;
+  }
+
+  payload_structure expected = {};
+  payload_structure payload = {};
+  char line[1024];
+  unsigned long bytes = 0;
+
+  processData(reference_line, strlen(reference_line), &expected);
+  while (fgets(line, sizeof(line), file) != NULL) {
+    size_t length = strcspn(line, "\n");
+    if (line[0] == '#' || length == 0) {
+      continue;
+    }
+    if (line[0] == 'x' && line[1] == ' ') {
+      char *cursor = line + 2;
+      char *end;
+      for (long byte = strtol(cursor, &end, 16); end != cursor; byte = strtol(cursor, &end, 16)) {
+        uint8_t value = (uint8_t)byte;
+        Serial.feed(&value, 1);
+        cursor = end;
+        bytes++;
+      }
+    } else {
+      line[length] = SERIAL_FRAME_TERMINATOR;
+      Serial.feed((const uint8_t *)line, length + 1);
+      bytes += length + 1;
+    }
+  }
+  fclose(file);
+
+  uint32_t frames_before = serial_rx_get_stats()->frames_ok;
+  uint32_t crc_errors_before = serial_rx_get_stats()->errors_crc;
+  while (Serial.available() > 0) {
+    read_serial_port(&buffer);
+  }
+  payload_buffer_read(&buffer, &payload);
+  if (serial_rx_get_stats()->frames_ok - frames_before < 2 || memcmp(&expected, &payload, sizeof(payload)) != 0) {
+    fail("receiver did not resynchronise after a binary burst");
+  }
+  if (serial_rx_get_stats()->errors_crc != crc_errors_before) {
+    fail("binary frame in the stream corpus lost a byte");
+  }
+  printf("%-22s %12lu bytes\n", "stream", bytes);
+}
+
+// A fixed-point field parses to the same value with fewer decimals, its
+// raw integer is rejected, and JSON shows it with the field's decimals
+static void checkFixedPoint() {
+  static const char *const equivalent[] = {
+    "2,2,1,-2.5,45,7,800,2,2.1,50,8,900,1,50,1200,1,60,1300,1,0,1,99",
+    "2,2,1,-2.50,45,7,800,2,2.10,50,8,900,1,50,1200,1,60,1300,1,0,1,99",
+  };
+  static const char raw_line[] = "2,2,1,-250,45,7,800,2,210,50,8,900,1,50,1200,1,60,1300,1,0,1,99";
+  payload_structure expected = {};
+  processData(reference_line, strlen(reference_line), &expected);
+
+  for (size_t i = 0; i < sizeof(equivalent) / sizeof(equivalent[0]); i++) {
+    payload_structure payload = {};
+    if (processData(equivalent[i], strlen(equivalent[i]), &payload) != FRAME_PARSE_OK
+        || memcmp(&expected, &payload, sizeof(payload)) != 0) {
+      printf("differs: %s\n", equivalent[i]);
+      fail("fixed-point value");
+    }
+  }
+  payload_structure payload = {};
+  if (processData(raw_line, strlen(raw_line), &payload) != FRAME_PARSE_ERROR_SYNTAX) {
+    fail("raw fixed-point value accepted");
+  }
+
+  telemetry_delta_state delta;
+  size_t length = 0;
+  sample_frame_count = 1;
+  telemetry_delta_reset(&delta);
+  json_length = 0;
+  telemetry_stream_batch(benchSampleSource, 1, 0, &delta, benchJsonSink, &length);
+  json[json_length] = '\0';
+  if (strstr(json, "\"sensor_1_temperature\": -2.50,") == NULL || strstr(json, "\"sensor_2_temperature\": 2.10,") == NULL) {
+    printf("json: %s\n", json);
+    fail("fixed-point JSON");
+  }
+}
+
+// Runs samples through the adaptive rate, each at the interval it asked for,
+// and returns the shortest and the last interval. The sensor 1 temperature
+// moves by step_centi per sample on top of a +-noise_centi square wave,
+// CO2 jitters by +-5.
+static void runAdaptiveRate(int32_t step_centi, int32_t noise_centi, uint32_t *shortest, uint32_t *last) {
+  payload_structure sample = {};
+  uint32_t now_ms = 0;
+
+  processData(reference_line, strlen(reference_line), &sample);
+  int16_t temperature = sample.sensors[0].temperature;
+  uint16_t co2 = sample.sensors[0].CO2;
+
+  *shortest = *last = adaptive_rate_reset();
+  for (int32_t i = 0; i < 200; i++) {
+    int32_t noise = (i % 2) ? noise_centi : -noise_centi;
+    sample.sensors[0].temperature = (int16_t)(temperature + step_centi * i + noise);
+    sample.sensors[0].CO2 = (uint16_t)(co2 + ((i % 2) ? 5 : -5));
+    now_ms += *last;
+    *last = adaptive_rate_next_interval(&sample, now_ms, 0);
+    if (*last < *shortest) {
+      *shortest = *last;
+    }
+  }
+}
+
+// One LSB of noise must not speed sampling up, a real trend must
+static void checkAdaptiveRate() {
+  const device_config *config = device_config_get();
+  uint32_t shortest;
+  uint32_t last;
+
+  runAdaptiveRate(0, 10, &shortest, &last);
+  if (shortest < (uint32_t)config->telemetry_interval_ms || last != (uint32_t)config->telemetry_interval_max_ms) {
+    printf("noise: shortest %lu last %lu ms\n", (unsigned long)shortest, (unsigned long)last);
+    fail("sensor noise lowered the telemetry interval");
+  }
+  uint32_t noise_interval = last;
+
+  runAdaptiveRate(30, 10, &shortest, &last);
+  if (shortest != (uint32_t)config->telemetry_interval_min_ms) {
+    printf("trend: shortest %lu ms\n", (unsigned long)shortest);
+    fail("a temperature trend did not lower the telemetry interval");
+  }
+  printf("%-22s %12lu ms noise, %lu ms trend\n", "adaptive rate", (unsigned long)noise_interval, (unsigned long)shortest);
+}
+
+// Mutates the reference frame and pushes it, wrapped in random noise,
+// through the receiver. A clean frame after the noise must always get through.
+static void fuzzReceiver() {
+  static payload_buffer buffer = {};
+  payload_structure payload = {};
+  payload_structure expected = {};
+  uint8_t chunk[SERIAL_FRAME_MAX_LENGTH * 2];
+
+  processData(reference_line, strlen(reference_line), &expected);
+
+  for (unsigned long round = 0; round < BENCH_FUZZ_ROUNDS; round++) {
+    size_t length = strlen(reference_line);
+    memcpy(chunk, reference_line, length);
+
+    for (uint32_t edits = 1 + nextRandom() % 4; edits > 0 && length > 1; edits--) {
+      size_t at = nextRandom() % length;
+      switch (nextRandom() % 4) {
+        case 0: chunk[at] = (uint8_t)nextRandom(); break;
+        case 1: memmove(chunk + at, chunk + at + 1, length - at - 1); length--; break;
+        case 2:
+          if (length < sizeof(chunk)) {
+            memmove(chunk + at + 1, chunk + at, length - at);
+            chunk[at] = (uint8_t)nextRandom();
+            length++;
+          }
+          break;
+        case 3: length = at + 1; break;
+      }
+    }
+
+    payload_structure before = payload;
+    frame_parse_result result = processData((const char *)chunk, length, &payload);
+    if (result != FRAME_PARSE_OK && memcmp(&before, &payload, sizeof(payload)) != 0) {
+      fail("rejected frame modified the payload");
+    }
+
+    // Noise, then enough filler that no binary frame can still be open, then
+    // a clean line
+    Serial.feed(chunk, length);
+    if (nextRandom() % 2) {
+      Serial.feed("\n");
+    }
+    for (int i = 0; i <= SERIAL_FRAME_MAX_LENGTH; i++) {
+      Serial.feed("x");
+    }
+    Serial.feed("\n");
+    Serial.feed(reference_line);
+    Serial.feed("\n");
+
+    uint32_t frames_before = serial_rx_get_stats()->frames_ok;
+    while (Serial.available() > 0) {
+      read_serial_port(&buffer);
+    }
+    payload_buffer_read(&buffer, &payload);
+    if (serial_rx_get_stats()->frames_ok == frames_before || memcmp(&expected, &payload, sizeof(payload)) != 0) {
+      fail("receiver did not resynchronise");
+      return;
+    }
+  }
+  printf("%-22s %12lu rounds\n", "fuzz", (unsigned long)BENCH_FUZZ_ROUNDS);
+}
+
+int main(int argc, char **argv) {
+  const char *corpus = argc > 1 ? argv[1] : BENCH_DEFAULT_CORPUS;
+  const char *stream_corpus = argc > 2 ? argv[2] : BENCH_DEFAULT_STREAM_CORPUS;
+
+  buildFullLine();
+  benchAsciiParse("processData", reference_line);
+  benchAsciiParse("processData full", full_line);
+  benchBinaryParse("processBinaryData", reference_line);
+  benchBinaryParse("processBinaryData full", full_line);
+  benchStream();
+  benchSerializeBatch("serialize keyframe", 1, 1);
+  benchSerializeBatch("serialize summary", 1, 8);
+  benchSerializeBatch("serialize batch", BENCH_BATCH_SAMPLES, 1);
+  benchSerializeDelta();
+  benchSerializePacked("serialize packed", 1);
+  benchSerializePacked("serialize packed sum", 8);
+  checkCorpus(corpus);
+  checkStream(stream_corpus);
+  checkFixedPoint();
+  checkAdaptiveRate();
+  fuzzReceiver();
+
+  const serial_rx_stats *stats = serial_rx_get_stats();
+  printf("rx ok %lu too_long %lu syntax %lu field_count %lu overflow %lu crc %lu\n",
+         (unsigned long)stats->frames_ok, (unsigned long)stats->frames_too_long,
+         (unsigned long)stats->errors_syntax, (unsigned long)stats->errors_field_count,
+         (unsigned long)stats->errors_overflow, (unsigned long)stats->errors_crc);
+
+  return failures == 0 ? 0 : 1;
+}
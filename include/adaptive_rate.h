@@ -0,0 +1,24 @@
+#pragma once
+
+#include <Arduino.h>
+#include <payload.h>
+
+// Picks the next telemetry interval from how fast the readings move and how
+// well the uplink is doing, within the bounds in device_config.h:
+//  - a CO2 or temperature reading changing faster than its rate threshold
+//    drops straight to the minimum interval. Rates are taken over the time
+//    since the reading last left its delta deadband, so noise of a few LSB
+//    never counts as movement,
+//  - the interval is held while a reading that dropped it still moves at
+//    ADAPTIVE_RATE_CALM_PERCENT of its threshold or more,
+//  - stable readings stretch the interval by ADAPTIVE_RATE_RELAX_PERCENT per
+//    sample, up to the maximum,
+//  - a weak signal or a failed publish doubles it (never below the base
+//    interval) so a congested link is not pushed harder.
+
+#define ADAPTIVE_RATE_RELAX_PERCENT 25
+#define ADAPTIVE_RATE_CALM_PERCENT 50
+
+uint32_t adaptive_rate_reset();
+void adaptive_rate_publish_result(bool published);
+uint32_t adaptive_rate_next_interval(const payload_structure *sample, uint32_t now_ms, int32_t rssi_dbm);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <Arduino.h>
+#include <payload.h>
+#include <sample_queue.h>
+
+// Streaming min/max/mean of every measurement over one telemetry window,
+// fed with each parsed serial frame. Constant memory per field slot: running
+// extremes and an integer sum, so the mean is exact in the field's
+// fixed-point units. A frame with different channel counts starts a new
+// window.
+
+void aggregator_add(const payload_structure *frame);
+uint32_t aggregator_frame_count();
+void aggregator_take(telemetry_sample *sample);
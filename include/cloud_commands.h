@@ -0,0 +1,41 @@
+#pragma once
+
+#include <Arduino.h>
+#include <az_core.h>
+#include <payload.h>
+
+// Cloud-to-device commands. A C2D message is a flat JSON object, e.g.
+//   { "fan_1_set_percent": 40, "relay_CO2": true, "telemetry_interval_ms": 30000 }
+// parsed in place. Keys name payload fields the way telemetry does, on any
+// channel the MCU reported in its latest frame (fan_<n>_set_percent), and
+// are checked against a static table of writable fields. Actuator settings are forwarded to the sensor MCU, the
+// telemetry interval is applied locally. A message is applied only if every
+// known key carries a valid value and the MCU command queue can take all of
+// its settings; unknown keys are skipped.
+
+#define CLOUD_COMMAND_INTERVAL_MIN_MS 1000
+#define CLOUD_COMMAND_INTERVAL_MAX_MS 3600000
+
+typedef enum {
+  CLOUD_COMMAND_OK = 0,
+  CLOUD_COMMAND_ERROR_JSON,   // not a flat JSON object
+  CLOUD_COMMAND_ERROR_VALUE,  // known key with a value of the wrong type or out of range
+  CLOUD_COMMAND_ERROR_BUSY,   // no room in the MCU command queue for the message, nothing was applied
+  CLOUD_COMMAND_ERROR_CHANNEL,  // writable field on a sensor or fan channel the MCU does not have
+} cloud_command_result;
+
+typedef struct {
+  uint32_t received;
+  uint32_t applied;
+  uint32_t errors_json;
+  uint32_t errors_value;
+  uint32_t errors_busy;
+  uint32_t errors_channel;
+  uint32_t unknown_keys;
+} cloud_command_stats;
+
+typedef void (*telemetry_interval_handler)(uint32_t period_ms);
+
+void cloud_commands_set_interval_handler(telemetry_interval_handler handler);
+cloud_command_result cloud_commands_process(az_span message, uint8_t sensor_count, uint8_t fan_count);
+const cloud_command_stats *cloud_commands_get_stats();
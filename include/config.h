@@ -10,7 +10,64 @@
 #define IOT_CONFIG_DEVICE_ID 
 #define IOT_CONFIG_DEVICE_KEY 
 
-// Publish 1 message every 2 seconds
+// Defaults of the telemetry tunables below marked (twin); the device twin can
+// change those at runtime, see device_config.h.
+
+// Publish 1 message every 2 seconds (twin)
 #define TELEMETRY_FREQUENCY_MILLISECS 15000
 
+// Adaptive sampling: the interval drops to TELEMETRY_MIN_INTERVAL_MILLISECS as soon as a
+// CO2 or temperature reading moves faster than its threshold (raw units per minute, so
+// centi-degrees per minute for temperature), then relaxes back past
+// TELEMETRY_FREQUENCY_MILLISECS up to TELEMETRY_MAX_INTERVAL_MILLISECS while readings are
+// stable. A weak signal or failed publishes back off further.
+// Set min and max to TELEMETRY_FREQUENCY_MILLISECS for a fixed rate. (twin)
+#define TELEMETRY_MIN_INTERVAL_MILLISECS 5000
+#define TELEMETRY_MAX_INTERVAL_MILLISECS 60000
+#define TELEMETRY_RATE_THRESHOLD_CO2 50
+#define TELEMETRY_RATE_THRESHOLD_TEMPERATURE 50
+#define TELEMETRY_CONGESTED_RSSI_DBM -80
+
+// Publish rate used to drain samples queued while the hub was unreachable
+#define TELEMETRY_DRAIN_INTERVAL_MILLISECS 200
+// Samples per message while more are queued than a live batch holds, even
+// with batching off, so a backlog goes out as batches (and packed, with
+// TELEMETRY_BATCH_ENCODING 1)
+#define TELEMETRY_DRAIN_BATCH_MAX_SAMPLES 16
+
+// Health report (heap, stack, loop timing, reconnects) as a separate message
+#define HEALTH_REPORT_INTERVAL_MILLISECS 300000
+
+// Batching: up to TELEMETRY_BATCH_MAX_SAMPLES samples are published as one JSON array,
+// or fewer once the oldest pending sample is TELEMETRY_BATCH_MAX_AGE_MILLISECS old.
+// 1 disables batching and publishes every sample as its own JSON object. (twin)
+#define TELEMETRY_BATCH_MAX_SAMPLES 1
+#define TELEMETRY_BATCH_MAX_AGE_MILLISECS 120000
+
+// Encoding of batches, see telemetry_encoding: 0 JSON, 1 delta+varint packed
+// samples, several times smaller when draining a long offline backlog. Single
+// samples are always JSON. (twin)
+#define TELEMETRY_BATCH_ENCODING 0
+
+// Delta reporting: between keyframes a field is only sent when it changed by more
+// than its deadband (raw sensor units, centi-degrees for temperature); other fields
+// only when they changed at all.
+// Every TELEMETRY_KEYFRAME_INTERVAL samples carry all fields and "keyframe": true.
+// 1 sends every field in every sample. (twin)
+#define TELEMETRY_KEYFRAME_INTERVAL 1
+#define TELEMETRY_DEADBAND_TEMPERATURE 20
+#define TELEMETRY_DEADBAND_HUMIDITY 2
+#define TELEMETRY_DEADBAND_CO2 25
 
+// Deep-sleep batch mode for remote sites. The ESP8266 sleeps between samples
+// and wakes every DEEP_SLEEP_INTERVAL_MILLISECS to take one from the sensor
+// MCU into RTC memory; only every DEEP_SLEEP_WAKES_PER_CONNECT-th wake powers
+// WiFi up and publishes everything collected as one batch. A wake waits at
+// most DEEP_SLEEP_COLLECT_TIMEOUT_MILLISECS for a frame and
+// DEEP_SLEEP_CONNECT_TIMEOUT_MILLISECS for the hub. Needs GPIO16 wired to RST.
+// 0 keeps the device awake and connected.
+#define DEEP_SLEEP_ENABLED 0
+#define DEEP_SLEEP_INTERVAL_MILLISECS 60000
+#define DEEP_SLEEP_WAKES_PER_CONNECT 10
+#define DEEP_SLEEP_COLLECT_TIMEOUT_MILLISECS 3000
+#define DEEP_SLEEP_CONNECT_TIMEOUT_MILLISECS 20000
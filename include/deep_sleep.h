@@ -0,0 +1,25 @@
+#pragma once
+
+#include <Arduino.h>
+#include <payload.h>
+#include <sample_queue.h>
+#include <time_base.h>
+
+// Sample store of the deep-sleep batch mode. RTC user memory survives deep
+// sleep, so samples taken on wakes without WiFi are kept there, packed like
+// the offline queue but with the window mean only, until a connect wake
+// publishes them. The store also carries the message sequence number and
+// the wall clock, see time_base.h, across sleeps. A CRC guards the image;
+// after a power loss or a corrupted image the store starts empty.
+
+#define DEEP_SLEEP_RTC_OFFSET 0      // in 4 byte blocks
+#define DEEP_SLEEP_RTC_BYTES 448     // the rest of the 512 byte user area holds wifi_cache.h
+
+bool deep_sleep_restore();
+bool deep_sleep_connect_due();
+void deep_sleep_store(const telemetry_sample *sample);
+bool deep_sleep_peek(size_t index, telemetry_sample *sample);
+size_t deep_sleep_sample_count();
+void deep_sleep_published(uint32_t next_sequence);
+uint32_t deep_sleep_sequence();
+void deep_sleep_enter(uint32_t sleep_ms);
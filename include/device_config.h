@@ -0,0 +1,51 @@
+#pragma once
+
+#include <Arduino.h>
+#include <az_core.h>
+#include <config.h>
+
+// Runtime copy of the telemetry tunables from config.h, adjusted through
+// the device twin. Desired properties use the field names below; every
+// value is range checked and a value that does not fit is ignored, so the
+// reported property keeps showing what the device actually runs with.
+// Reported properties only carry the fields that differ from what the hub
+// last acknowledged.
+
+// X(id, name, default, min, max)
+#define DEVICE_CONFIG_FIELDS(X)                                                                  \
+  X(CONFIG_TELEMETRY_INTERVAL, telemetry_interval_ms, TELEMETRY_FREQUENCY_MILLISECS, 1000, 3600000) \
+  X(CONFIG_TELEMETRY_INTERVAL_MIN, telemetry_interval_min_ms, TELEMETRY_MIN_INTERVAL_MILLISECS, 1000, 3600000) \
+  X(CONFIG_TELEMETRY_INTERVAL_MAX, telemetry_interval_max_ms, TELEMETRY_MAX_INTERVAL_MILLISECS, 1000, 3600000) \
+  X(CONFIG_RATE_THRESHOLD_CO2, rate_threshold_co2, TELEMETRY_RATE_THRESHOLD_CO2, 1, 10000)         \
+  X(CONFIG_RATE_THRESHOLD_TEMPERATURE, rate_threshold_temperature, TELEMETRY_RATE_THRESHOLD_TEMPERATURE, 1, 10000) \
+  X(CONFIG_BATCH_MAX_SAMPLES, batch_max_samples, TELEMETRY_BATCH_MAX_SAMPLES, 1, 32)             \
+  X(CONFIG_BATCH_MAX_AGE, batch_max_age_ms, TELEMETRY_BATCH_MAX_AGE_MILLISECS, 0, 3600000)       \
+  X(CONFIG_BATCH_ENCODING, batch_encoding, TELEMETRY_BATCH_ENCODING, 0, 1)                        \
+  X(CONFIG_KEYFRAME_INTERVAL, keyframe_interval, TELEMETRY_KEYFRAME_INTERVAL, 1, 1000)           \
+  X(CONFIG_DEADBAND_TEMPERATURE, deadband_temperature, TELEMETRY_DEADBAND_TEMPERATURE, 0, 1000)  \
+  X(CONFIG_DEADBAND_HUMIDITY, deadband_humidity, TELEMETRY_DEADBAND_HUMIDITY, 0, 100)            \
+  X(CONFIG_DEADBAND_CO2, deadband_co2, TELEMETRY_DEADBAND_CO2, 0, 5000)
+
+typedef enum {
+#define CONFIG_ID(id, name, def, min, max) id,
+  DEVICE_CONFIG_FIELDS(CONFIG_ID)
+#undef CONFIG_ID
+  DEVICE_CONFIG_COUNT
+} device_config_id;
+
+typedef struct {
+#define CONFIG_MEMBER(id, name, def, min, max) int32_t name;
+  DEVICE_CONFIG_FIELDS(CONFIG_MEMBER)
+#undef CONFIG_MEMBER
+} device_config;
+
+// Field names and values only, e.g. `, "telemetry_interval_ms": 3600000`
+#define DEVICE_CONFIG_FIELD_MAX_LENGTH(id, name, def, min, max) +(sizeof(", \"" #name "\": ") - 1 + 11)
+#define DEVICE_CONFIG_REPORTED_MAX_LENGTH (4 DEVICE_CONFIG_FIELDS(DEVICE_CONFIG_FIELD_MAX_LENGTH))
+
+const device_config *device_config_get();
+bool device_config_set(device_config_id id, int32_t value);
+bool device_config_process_twin(az_span document, bool is_patch);
+bool device_config_report_pending();
+az_span device_config_write_reported(az_span destination);
+void device_config_report_done(bool accepted);
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Arduino.h>
+#include <az_core.h>
+
+// Device health counters, published as a separate low-rate message so heap
+// fragmentation and reconnect storms show up before a unit falls over.
+
+#include <profiler.h>
+
+// 21 entries of a fixed key and a u32, ~30 bytes each, followed by the profile
+#define HEALTH_PAYLOAD_SIZE (640 + PROFILER_JSON_MAX_LENGTH)
+
+typedef enum {
+  HEALTH_EVENT_WIFI_CONNECT,
+  HEALTH_EVENT_MQTT_CONNECT,
+  HEALTH_EVENT_MQTT_DISCONNECT,
+  HEALTH_EVENT_PUBLISH_FAILED,
+  HEALTH_EVENT_TWIN_GET_TIMEOUT,  // no twin document, e.g. one larger than the MQTT packet buffer
+  HEALTH_EVENT_COUNT
+} health_event;
+
+void health_record_loop(uint32_t busy_us);
+void health_count(health_event event);
+void health_sample();
+az_span health_write_payload(az_span destination);
+void health_window_reset();
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Debug log with compile-time levels. Calls above LOG_LEVEL compile to
+// nothing, arguments included, so release builds keep no format strings and
+// spend no cycles on them. Format strings live in flash (PSTR). LOG_SINK
+// picks where lines go:
+//   LOG_SINK_SERIAL   the UART shared with the sensor MCU
+//   LOG_SINK_SERIAL1  UART1, TX only on GPIO2; the LED shares that pin and stays unused
+//   LOG_SINK_RING     a RAM ring of LOG_RING_BYTES, printed by the "!log" console command
+// Override with e.g. -DLOG_LEVEL=LOG_LEVEL_WARN -DLOG_SINK=LOG_SINK_RING.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_SINK_SERIAL 1
+#define LOG_SINK_SERIAL1 2
+#define LOG_SINK_RING 3
+
+#ifndef LOG_SINK
+#define LOG_SINK LOG_SINK_SERIAL
+#endif
+
+#define LOG_SERIAL1_BAUD_RATE 115200
+#define LOG_RING_BYTES 2048
+#define LOG_LINE_MAX_LENGTH 128  // longer lines are cut
+
+// Disabled calls still type check their arguments, but never evaluate them
+#define LOG_DISCARD(format, ...)                 \
+  do {                                           \
+    if (false) {                                 \
+      logger_write(0, format, ##__VA_ARGS__);    \
+    }                                            \
+  } while (0)
+
+void logger_begin();
+void logger_write(uint8_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+void logger_dump(Print &out);
+void logger_flush();
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(format, ...) logger_write(LOG_LEVEL_ERROR, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_ERROR(format, ...) LOG_DISCARD(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(format, ...) logger_write(LOG_LEVEL_WARN, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_WARN(format, ...) LOG_DISCARD(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(format, ...) logger_write(LOG_LEVEL_INFO, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_INFO(format, ...) LOG_DISCARD(format, ##__VA_ARGS__)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(format, ...) logger_write(LOG_LEVEL_DEBUG, PSTR(format), ##__VA_ARGS__)
+#else
+#define LOG_DEBUG(format, ...) LOG_DISCARD(format, ##__VA_ARGS__)
+#endif
@@ -4,43 +4,189 @@
 #include <az_core.h>
 #include <az_iot.h>
 
+typedef enum {
+  FIELD_KIND_TYPE,         // sensor/fan type identifier
+  FIELD_KIND_TEMPERATURE,
+  FIELD_KIND_HUMIDITY,
+  FIELD_KIND_LIGHT,
+  FIELD_KIND_CO2,
+  FIELD_KIND_PERCENT,
+  FIELD_KIND_SPEED,
+  FIELD_KIND_STATE,        // relay/output state
+} payload_field_kind;
 
-typedef struct  {
-// data-time TODO
-
-// ----Sensor-1---- //
-uint8_t sensor_1_type ;
-uint16_t sensor_1_temperature;  // negative ?
-uint8_t sensors_1_humidity;
-uint8_t sensor_1_light;  // opt
-uint16_t sensor_1_CO2;  // opt
-// ----Sensor-2---- //
-uint8_t sensor_2_type ;
-uint16_t sensor_2_temperature;  // negative ?
-uint8_t sensors_2_humidity;
-uint8_t sensor_2_light;  // opt
-uint16_t sensor_2_CO2;  // opt
-// ----Fan-1---- //
-uint8_t fan_1_type ;
-uint8_t fan_1_set_percent;
-uint16_t fan_1_speed;
-
-// ----Fan-2---- //
-uint8_t fan_2_type ;
-uint8_t fan_2_set_percent;
-uint16_t fan_2_speed;
-
-// ---- Outputs --- //
-
-uint8_t relay_CO2;
-uint8_t relay_programmable_1;
-uint8_t relay_programmable_2;
-uint8_t pwm_light;
+// Measured quantities, summarized as min/mean/max over a telemetry window.
+// Identifiers, set points and states are reported as their last value.
+#define PAYLOAD_KIND_IS_MEASUREMENT(kind)                                                          \
+  ((kind) == FIELD_KIND_TEMPERATURE || (kind) == FIELD_KIND_HUMIDITY || (kind) == FIELD_KIND_LIGHT \
+   || (kind) == FIELD_KIND_CO2 || (kind) == FIELD_KIND_SPEED)
+
+// Channels the payload has room for. Every frame says how many it actually
+// carries; the serial link, the offline queue and the telemetry messages
+// only ever hold the channels that are present.
+#ifndef PAYLOAD_MAX_SENSORS
+#define PAYLOAD_MAX_SENSORS 16
+#endif
+#ifndef PAYLOAD_MAX_FANS
+#define PAYLOAD_MAX_FANS 4
+#endif
+
+// Single description of the fields of one channel of each group. The
+// structs, the serial parser, the binary codec and the JSON serializer are
+// all generated from it, so adding a field is one line here. Table order is
+// the serial frame order and the JSON key order within a channel.
+//
+// X(id, name, type, kind, quoted, scale)
+//   quoted - emitted as a JSON string instead of a number
+//   scale  - number of fixed-point decimals in the raw value; the raw integer
+//            is what the structs, the binary codec, aggregation and delta
+//            deadbands work with, JSON and ASCII serial frames show the
+//            decimal point
+//
+// Temperature is in centi-degrees Celsius, -327.68 to 327.67.
+#define SENSOR_CHANNEL_FIELDS(X)                                                 \
+  X(SENSOR_FIELD_TYPE, type, uint8_t, FIELD_KIND_TYPE, true, 0)                  \
+  X(SENSOR_FIELD_TEMPERATURE, temperature, int16_t, FIELD_KIND_TEMPERATURE, false, 2) \
+  X(SENSOR_FIELD_HUMIDITY, humidity, uint8_t, FIELD_KIND_HUMIDITY, false, 0)     \
+  X(SENSOR_FIELD_LIGHT, light, uint8_t, FIELD_KIND_LIGHT, false, 0)              \
+  X(SENSOR_FIELD_CO2, CO2, uint16_t, FIELD_KIND_CO2, false, 0)
+
+#define FAN_CHANNEL_FIELDS(X)                                                    \
+  X(FAN_FIELD_TYPE, type, uint8_t, FIELD_KIND_TYPE, true, 0)                     \
+  X(FAN_FIELD_SET_PERCENT, set_percent, uint8_t, FIELD_KIND_PERCENT, false, 0)   \
+  X(FAN_FIELD_SPEED, speed, uint16_t, FIELD_KIND_SPEED, false, 0)
+
+// Outputs of the controller itself, one of each
+#define CONTROLLER_FIELDS(X)                                                     \
+  X(CONTROLLER_FIELD_RELAY_CO2, relay_CO2, uint8_t, FIELD_KIND_STATE, false, 0)  \
+  X(CONTROLLER_FIELD_RELAY_PROGRAMMABLE_1, relay_programmable_1, uint8_t, FIELD_KIND_STATE, false, 0) \
+  X(CONTROLLER_FIELD_RELAY_PROGRAMMABLE_2, relay_programmable_2, uint8_t, FIELD_KIND_STATE, false, 0) \
+  X(CONTROLLER_FIELD_PWM_LIGHT, pwm_light, uint8_t, FIELD_KIND_PERCENT, false, 0)
+
+#define PAYLOAD_STRUCT_MEMBER(id, name, type, kind, quoted, scale) type name;
+#define PAYLOAD_FIELD_ID(id, name, type, kind, quoted, scale) id,
+#define PAYLOAD_FIELD_SIZE(id, name, type, kind, quoted, scale) +sizeof(type)
+
+// Channels are packed: mixed uint8/uint16 members without padding, so the
+// struct is as small as the wire format. Members are only ever accessed by
+// value, never through pointers, since they may be unaligned.
+typedef struct __attribute__((packed)) {
+  SENSOR_CHANNEL_FIELDS(PAYLOAD_STRUCT_MEMBER)
+} sensor_channel;
+
+typedef struct __attribute__((packed)) {
+  FAN_CHANNEL_FIELDS(PAYLOAD_STRUCT_MEMBER)
+} fan_channel;
+
+typedef struct {
+  uint8_t sensor_count;  // channels in use, sensors[0..sensor_count)
+  uint8_t fan_count;
+  CONTROLLER_FIELDS(PAYLOAD_STRUCT_MEMBER)
+  sensor_channel sensors[PAYLOAD_MAX_SENSORS];
+  fan_channel fans[PAYLOAD_MAX_FANS];
 } payload_structure;
 
+// Field ids within a channel, in serial frame order
+typedef enum { SENSOR_CHANNEL_FIELDS(PAYLOAD_FIELD_ID) SENSOR_CHANNEL_FIELD_COUNT } sensor_field_id;
+typedef enum { FAN_CHANNEL_FIELDS(PAYLOAD_FIELD_ID) FAN_CHANNEL_FIELD_COUNT } fan_field_id;
+typedef enum { CONTROLLER_FIELDS(PAYLOAD_FIELD_ID) CONTROLLER_FIELD_COUNT } controller_field_id;
 
-extern payload_structure payload_data;
+#undef PAYLOAD_STRUCT_MEMBER
+#undef PAYLOAD_FIELD_ID
 
+// Telemetry keys of channel fields: prefix, 1 based channel number, '_',
+// field name, e.g. "sensor_3_CO2". Controller fields use the bare name.
+#define PAYLOAD_SENSOR_KEY_PREFIX "sensor_"
+#define PAYLOAD_FAN_KEY_PREFIX "fan_"
 
-#endif
+typedef enum {
+  PAYLOAD_GROUP_SENSOR,
+  PAYLOAD_GROUP_FAN,
+  PAYLOAD_GROUP_CONTROLLER,
+} payload_group;
+
+// Every field of every channel the payload can hold has a fixed slot: all
+// sensor channels first, then the fans, then the controller outputs. Slots
+// address fields in delta masks and in set commands to the sensor MCU.
+typedef uint16_t payload_slot;
+
+#define PAYLOAD_SENSOR_SLOT(channel, field) ((channel) * SENSOR_CHANNEL_FIELD_COUNT + (field))
+#define PAYLOAD_FAN_SLOT(channel, field) \
+  (PAYLOAD_SENSOR_SLOT(PAYLOAD_MAX_SENSORS, 0) + (channel) * FAN_CHANNEL_FIELD_COUNT + (field))
+#define PAYLOAD_CONTROLLER_SLOT(field) (PAYLOAD_FAN_SLOT(PAYLOAD_MAX_FANS, 0) + (field))
+#define PAYLOAD_SLOT_COUNT PAYLOAD_CONTROLLER_SLOT(CONTROLLER_FIELD_COUNT)
+
+// One bit per slot
+#define PAYLOAD_MASK_WORDS ((PAYLOAD_SLOT_COUNT + 31) / 32)
+
+typedef struct {
+  uint32_t bits[PAYLOAD_MASK_WORDS];
+} payload_slot_mask;
 
+static inline void payload_mask_set(payload_slot_mask *mask, payload_slot slot) {
+  mask->bits[slot / 32] |= 1UL << (slot % 32);
+}
+
+static inline bool payload_mask_test(const payload_slot_mask *mask, payload_slot slot) {
+  return (mask->bits[slot / 32] >> (slot % 32)) & 1;
+}
+
+// Position of one field while walking a payload
+typedef struct {
+  payload_slot slot;
+  uint8_t group;    // payload_group
+  uint8_t channel;  // 0 based; 0 for the controller
+  uint8_t field;    // sensor_field_id, fan_field_id or controller_field_id
+} payload_cursor;
+
+typedef struct {
+  const char *name;  // member name, e.g. "CO2"
+  uint8_t name_length;
+  payload_field_kind kind;
+  bool quoted;
+  uint8_t scale;
+  uint8_t size;      // bytes on the serial link and in the offline queue
+  int32_t min;       // range of the member type
+  int32_t max;
+} payload_field_info;
+
+// Packed form used by binary frames and the offline queue: sensor count,
+// fan count (one byte each), then the fields of the channels present,
+// little-endian, sensors first, then fans, then the controller outputs.
+#define PAYLOAD_HEADER_LENGTH 2
+#define PAYLOAD_SENSOR_CHANNEL_LENGTH (0 SENSOR_CHANNEL_FIELDS(PAYLOAD_FIELD_SIZE))
+#define PAYLOAD_FAN_CHANNEL_LENGTH (0 FAN_CHANNEL_FIELDS(PAYLOAD_FIELD_SIZE))
+#define PAYLOAD_CONTROLLER_LENGTH (0 CONTROLLER_FIELDS(PAYLOAD_FIELD_SIZE))
+#define PAYLOAD_PACKED_LENGTH(sensors, fans)                                                   \
+  (PAYLOAD_HEADER_LENGTH + (sensors) * PAYLOAD_SENSOR_CHANNEL_LENGTH + (fans) * PAYLOAD_FAN_CHANNEL_LENGTH \
+   + PAYLOAD_CONTROLLER_LENGTH)
+#define PAYLOAD_PACKED_MAX_LENGTH PAYLOAD_PACKED_LENGTH(PAYLOAD_MAX_SENSORS, PAYLOAD_MAX_FANS)
+
+// Fields of a frame with every channel present, counts included
+#define PAYLOAD_MAX_FIELD_COUNT                                                                \
+  (2 + PAYLOAD_MAX_SENSORS * SENSOR_CHANNEL_FIELD_COUNT + PAYLOAD_MAX_FANS * FAN_CHANNEL_FIELD_COUNT \
+   + CONTROLLER_FIELD_COUNT)
+
+static_assert(PAYLOAD_MAX_SENSORS <= 99 && PAYLOAD_MAX_FANS <= 99, "channel numbers in keys are two digits");
+static_assert(sizeof(sensor_channel) == PAYLOAD_SENSOR_CHANNEL_LENGTH, "sensor channel is not packed");
+
+bool payload_set_channels(payload_structure *payload, int32_t sensor_count, int32_t fan_count);
+bool payload_same_channels(const payload_structure *a, const payload_structure *b);
+
+bool payload_begin(const payload_structure *payload, payload_cursor *cursor);
+bool payload_next(const payload_structure *payload, payload_cursor *cursor);
+bool payload_seek(payload_slot slot, payload_cursor *cursor);
+bool payload_find(az_span key, payload_cursor *cursor);
+
+const payload_field_info *payload_field(const payload_cursor *cursor);
+int32_t payload_get(const payload_structure *payload, const payload_cursor *cursor);
+bool payload_set(payload_structure *payload, const payload_cursor *cursor, int32_t value);
+az_span payload_write_key(az_span destination, const payload_cursor *cursor);
+
+size_t payload_packed_length(const payload_structure *payload);
+size_t payload_pack(const payload_structure *payload, uint8_t *out);
+size_t payload_unpack(const uint8_t *in, size_t length, payload_structure *payload);
+
+
+
+#endif
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <Arduino.h>
+#include <payload.h>
+
+// Latest frame from the sensor MCU, double buffered. The single writer
+// parses every frame into the slot readers are not looking at and then
+// publishes it with one counter store, so it never waits for a reader and
+// readers never see a half-written frame. Readers use the latest slot in
+// place and afterwards check that the writer did not start to overwrite it
+// meanwhile (seqlock), retrying in the rare case it did:
+//   do {
+//     latest = payload_buffer_read_begin(&buffer, &sequence);
+//     ... use *latest ...
+//   } while (!payload_buffer_read_end(&buffer, sequence));
+
+typedef struct {
+  payload_structure slots[2];
+  volatile uint32_t started;    // frames the writer began; slots[started & 1] is being written
+  volatile uint32_t published;  // frames completed; slots[published & 1] is the latest
+} payload_buffer;
+
+payload_structure *payload_buffer_write_begin(payload_buffer *buffer);
+void payload_buffer_write_end(payload_buffer *buffer, bool publish);
+
+const payload_structure *payload_buffer_read_begin(const payload_buffer *buffer, uint32_t *sequence);
+bool payload_buffer_read_end(const payload_buffer *buffer, uint32_t sequence);
+void payload_buffer_read(const payload_buffer *buffer, payload_structure *out);
@@ -2,16 +2,86 @@
 
 #include<Arduino.h>
 #include<payload.h>
+#include<payload_buffer.h>
 
 
 
-#define MAX_VALUES 5
-#define MAX_TOKEN_LENGTH 20  // Adjust the maximum token length as needed
+// Serial protocol selection, override with -DSERIAL_PROTOCOL_MODE=... in platformio.ini
+#define SERIAL_PROTOCOL_ASCII 1   // comma separated decimals terminated by '\n'
+#define SERIAL_PROTOCOL_BINARY 2  // COBS wrapped little-endian fields + CRC16, see serial_protocol.h
+#define SERIAL_PROTOCOL_AUTO 3    // accept both, told apart by terminator and content
 
-void read_serial_port(payload_structure *ptr_payload_data);
-void processData(String data, payload_structure *ptr_payload_data);
-bool isNumeric(const char *str);
+#ifndef SERIAL_PROTOCOL_MODE
+#define SERIAL_PROTOCOL_MODE SERIAL_PROTOCOL_AUTO
+#endif
 
+// UART link to the sensor MCU. The core's RX interrupt moves bytes from the
+// 128 byte hardware FIFO into a ring of SERIAL_RX_BUFFER_SIZE bytes once
+// SERIAL_RX_FIFO_FULL_THRESHOLD bytes are waiting, or the line has been idle
+// for SERIAL_RX_FIFO_TIMEOUT byte times with fewer, so a burst only has to
+// fit the ring between two runs of the receiver. Bytes lost when it does not
+// are counted as overruns.
+#ifndef SERIAL_BAUD_RATE
+#define SERIAL_BAUD_RATE 115200
+#endif
+#ifndef SERIAL_RX_BUFFER_SIZE
+#define SERIAL_RX_BUFFER_SIZE 1024
+#endif
+#define SERIAL_RX_FIFO_FULL_THRESHOLD 64
+#define SERIAL_RX_FIFO_TIMEOUT 2
 
+// Serial frame receiver
+#define SERIAL_FRAME_TERMINATOR '\n'
+#define SERIAL_FRAME_SEPARATOR ','
+#define SERIAL_FRAME_DECIMAL_POINT '.'     // required in fields with a fixed-point scale, invalid elsewhere
+#define SERIAL_COMMAND_PREFIX '!'         // text lines starting with this are console commands
+#define SERIAL_FRAME_MAX_LENGTH (PAYLOAD_MAX_FIELD_COUNT * 8)  // every channel, sign, 5 digits, point, separator
+#define SERIAL_RX_MAX_BYTES_PER_CALL 64    // bounds the time spent in read_serial_port()
 
+// Commands to the sensor MCU. ASCII: "=<slot>,<value>\n"; binary: a
+// COBS wrapped SERIAL_FRAME_TYPE_SET frame. Queued commands are written
+// only while they fit in the UART TX FIFO, so sending never blocks.
+#define SERIAL_SET_COMMAND_PREFIX '='
+#define SERIAL_TX_QUEUE_LENGTH 8
+#define SERIAL_SET_FRAME_LENGTH (1 + 2 + 4 + 2)
+#define SERIAL_SET_LINE_MAX_LENGTH (1 + 5 + 1 + 11 + 1)
 
+#define SERIAL_BINARY_FRAME_MAX_LENGTH (1 + PAYLOAD_PACKED_MAX_LENGTH + 2)
+
+typedef enum {
+  FRAME_PARSE_OK = 0,
+  FRAME_PARSE_ERROR_SYNTAX,       // empty field, a character that is not a digit/sign/point, a misplaced or missing point, or excess decimals
+  FRAME_PARSE_ERROR_FIELD_COUNT,  // channel count out of range, or fields not matching it
+  FRAME_PARSE_ERROR_OVERFLOW,     // value does not fit the target field
+  FRAME_PARSE_ERROR_CRC,          // binary frame failed COBS decoding or CRC check
+} frame_parse_result;
+
+typedef struct {
+  uint32_t frames_ok;
+  uint32_t frames_too_long;
+  uint32_t errors_syntax;
+  uint32_t errors_field_count;
+  uint32_t errors_overflow;
+  uint32_t errors_crc;
+  uint32_t overruns;     // the RX ring was full and bytes were lost
+  uint32_t line_errors;  // framing or parity errors and breaks seen by the UART
+} serial_rx_stats;
+
+typedef void (*serial_command_handler)(const char *command, size_t length);
+typedef void (*serial_frame_handler)(const payload_structure *payload);
+
+void serial_begin();
+void read_serial_port(payload_buffer *buffer);
+void serial_set_command_handler(serial_command_handler handler);
+void serial_set_frame_handler(serial_frame_handler handler);
+frame_parse_result processData(const char *data, size_t length, payload_structure *ptr_payload_data);
+frame_parse_result processBinaryData(uint8_t *data, size_t length, payload_structure *ptr_payload_data);
+size_t encodeBinaryFrame(const payload_structure *ptr_payload_data, uint8_t *out, size_t size);
+const serial_rx_stats *serial_rx_get_stats();
+
+bool serial_queue_command(payload_slot slot, int32_t value);
+bool serial_command_queued(payload_slot slot);
+size_t serial_command_space();
+void serial_discard_commands();
+void serial_flush_commands();
+size_t encodeSetCommand(payload_slot slot, int32_t value, uint8_t *out, size_t size);
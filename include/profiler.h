@@ -0,0 +1,44 @@
+#pragma once
+
+#include <Arduino.h>
+#include <az_core.h>
+
+// Cycle-counter based latency profile of the hot path. Every stage keeps
+// count/min/max/total plus a log2 histogram, from which p99 is estimated,
+// in a fixed static table. Build with -DPROFILER_ENABLED=0 to compile the
+// probes out.
+
+#ifndef PROFILER_ENABLED
+#define PROFILER_ENABLED 1
+#endif
+
+#define PROFILER_BUCKETS 24  // bucket n holds durations in [2^n, 2^(n+1)) cycles; the last one is open ended
+
+typedef enum {
+  PROFILE_SERIAL_READ,
+  PROFILE_PROCESS_DATA,
+  PROFILE_TELEMETRY_PAYLOAD,
+  PROFILE_PUBLISH_TOPIC,
+  PROFILE_MQTT_PUBLISH,
+  PROFILE_MQTT_LOOP,
+  PROFILE_STAGE_COUNT
+} profile_stage;
+
+#if PROFILER_ENABLED
+
+static inline uint32_t profiler_begin() { return ESP.getCycleCount(); }
+void profiler_end(profile_stage stage, uint32_t start_cycles);
+
+#else
+
+static inline uint32_t profiler_begin() { return 0; }
+static inline void profiler_end(profile_stage, uint32_t) {}
+
+#endif
+
+void profiler_reset();
+void profiler_dump(Print &out);
+az_span profiler_write_json(az_span destination);
+
+// Worst case of profiler_write_json(): per stage the name and five u32 values
+#define PROFILER_JSON_MAX_LENGTH (16 + PROFILE_STAGE_COUNT * (24 + 5 * 12))
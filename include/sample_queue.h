@@ -0,0 +1,43 @@
+#pragma once
+
+#include <Arduino.h>
+#include <payload.h>
+
+// Store-and-forward queue for telemetry samples. Samples are held packed,
+// with only the channels they carry, in a static RAM byte ring; when the
+// ring is full the oldest sample is spilled to an append-only LittleFS log,
+// so everything in flash is always older than everything in RAM and the
+// queue drains in capture order. Fewer channels means more samples fit.
+
+#ifndef SAMPLE_QUEUE_RAM_BYTES
+#define SAMPLE_QUEUE_RAM_BYTES 4096  // about 40 samples of two sensors and two fans
+#endif
+#ifndef SAMPLE_QUEUE_FLASH_MAX_BYTES
+#define SAMPLE_QUEUE_FLASH_MAX_BYTES (256 * 1024)
+#endif
+#define SAMPLE_QUEUE_INDEX_SYNC_EVERY 16  // pops between persisting the flash read offset
+
+// One telemetry window. Measurements (PAYLOAD_KIND_IS_MEASUREMENT) hold the
+// mean in payload and their extremes in payload_min/payload_max; every
+// other field holds its last value in all three.
+typedef struct {
+  uint32_t timestamp;  // seconds since epoch at capture, 0 if the clock was not set yet
+  uint16_t frame_count;  // serial frames aggregated, 0 if none arrived and payload is stale
+  payload_structure payload;
+  payload_structure payload_min;
+  payload_structure payload_max;
+} telemetry_sample;
+
+typedef struct {
+  uint32_t pushed;
+  uint32_t spilled;
+  uint32_t dropped;
+  uint32_t flash_errors;
+} sample_queue_stats;
+
+bool sample_queue_init();
+void sample_queue_push(const telemetry_sample *sample);
+bool sample_queue_peek(size_t index, telemetry_sample *sample);
+void sample_queue_pop(size_t count);
+size_t sample_queue_count();
+const sample_queue_stats *sample_queue_get_stats();
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Cooperative, millis() based scheduler. Every task is released once per
+// period_ms; a task that starts more than deadline_ms after its release is
+// counted as a deadline miss. All time comparisons are wraparound safe.
+
+#define SCHEDULER_MAX_IDLE_MS 50  // upper bound for a single idle wait
+
+typedef void (*task_callback)();
+
+typedef struct {
+  const char *name;
+  task_callback callback;
+  uint32_t period_ms;
+  uint32_t deadline_ms;
+  uint32_t next_run_ms;
+  uint32_t run_count;
+  uint32_t deadline_misses;
+} scheduler_task;
+
+void scheduler_init(scheduler_task *tasks, size_t count);
+uint32_t scheduler_run(scheduler_task *tasks, size_t count);
+uint32_t scheduler_total_deadline_misses();
+scheduler_task *scheduler_find(const char *name);
+void scheduler_set_period(scheduler_task *task, uint32_t period_ms);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Binary framing used on the sensor MCU link:
+//   COBS( frame_type | packed payload, see payload.h | CRC16 LE )  0x00
+// COBS guarantees the encoded frame is free of 0x00, so the zero byte is a
+// reliable frame delimiter and resynchronisation point.
+
+#define SERIAL_COBS_DELIMITER 0x00
+// 0x01 was the fixed two-sensor/two-fan layout, no longer accepted
+#define SERIAL_FRAME_TYPE_SET 0x02       // ESP -> MCU: slot (u16 LE), value (i32 LE)
+#define SERIAL_FRAME_TYPE_CHANNELS 0x03  // MCU -> ESP: channel counts, then the fields of those channels
+
+// Worst case COBS overhead is one byte per 254 input bytes, plus the leading code byte.
+#define COBS_ENCODED_MAX_LENGTH(n) ((n) + ((n) / 254) + 1)
+
+size_t cobs_encode(const uint8_t *src, size_t length, uint8_t *dst);
+size_t cobs_decode(const uint8_t *src, size_t length, uint8_t *dst);
+
+// CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF)
+uint16_t crc16_ccitt(const uint8_t *data, size_t length, uint16_t crc = 0xFFFF);
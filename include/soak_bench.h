@@ -0,0 +1,45 @@
+#pragma once
+
+#include <Arduino.h>
+#include <payload.h>
+
+// Throughput and soak benchmark of the bench firmware, [env:esp12e_bench].
+// The sensor MCU is replaced by a synthetic frame generator: UART0 is put in
+// loopback, so generated frames leave through TX and come back through the
+// RX FIFO, the interrupt ring, the parser and the aggregator exactly like
+// real ones, and from there are sampled, serialized and published as usual.
+// Every field changes on every frame, the worst case for delta reporting.
+// Set commands for the MCU are discarded, they would loop back as well.
+//
+// A short report is logged every BENCH_REPORT_INTERVAL_MILLISECS: frames
+// generated and parsed per second, frames lost, publishes and their
+// latency, and the heap low-water marks since boot. The log has to go to
+// UART1 (LOG_SINK_SERIAL1), UART0 carries the frames.
+
+#ifndef BENCH_ENABLED
+#define BENCH_ENABLED 0
+#endif
+#ifndef BENCH_FRAME_RATE_HZ
+#define BENCH_FRAME_RATE_HZ 20
+#endif
+#ifndef BENCH_SENSORS
+#define BENCH_SENSORS 4
+#endif
+#ifndef BENCH_FANS
+#define BENCH_FANS 2
+#endif
+#ifndef BENCH_REPORT_INTERVAL_MILLISECS
+#define BENCH_REPORT_INTERVAL_MILLISECS 60000
+#endif
+
+// Frames the generator may fall behind before it skips them; skipped frames
+// mean the link, not the receiver, is the limit at this rate.
+#define BENCH_MAX_BACKLOG_FRAMES 4
+
+static_assert(BENCH_SENSORS <= PAYLOAD_MAX_SENSORS && BENCH_FANS <= PAYLOAD_MAX_FANS, "bench channels do not fit");
+
+void soak_bench_begin();
+void soak_bench_feed();
+void soak_bench_publish(uint32_t latency_us, bool published);
+void soak_bench_sample();
+void soak_bench_report();
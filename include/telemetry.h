@@ -0,0 +1,107 @@
+#pragma once
+
+#include <az_core.h>
+#include <payload.h>
+#include <sample_queue.h>
+
+#include <limits>
+
+// Every field is written as `, "<key>": <value>`, measurements of a
+// summarized window add `<key>_min` and `<key>_max` the same way.
+#define TELEMETRY_KEY_FRAGMENT_LENGTH (sizeof(", \"\": ") - 1)
+#define TELEMETRY_STATS_SUFFIX_LENGTH (sizeof("_min") - 1)
+
+template <typename T>
+constexpr size_t telemetryMaxDigits() {
+  return std::numeric_limits<T>::digits10 + 1 + (std::numeric_limits<T>::is_signed ? 1 : 0);
+}
+
+// Widest output of one field with a key of at most key_length characters:
+// fragment, sign and digits, decimal point and leading zero for fixed-point
+// values, quotes; measurements add their window minimum and maximum.
+#define TELEMETRY_VALUE_MAX_LENGTH(type, scale) (telemetryMaxDigits<type>() + ((scale) > 0 ? 2 : 0))
+#define TELEMETRY_FIELD_MAX_LENGTH(key_length, type, kind, quoted, scale)                               \
+  (TELEMETRY_KEY_FRAGMENT_LENGTH + (key_length) + TELEMETRY_VALUE_MAX_LENGTH(type, scale) + ((quoted) ? 2 : 0) \
+   + (PAYLOAD_KIND_IS_MEASUREMENT(kind)                                                                 \
+          ? 2 * (TELEMETRY_KEY_FRAGMENT_LENGTH + (key_length) + TELEMETRY_STATS_SUFFIX_LENGTH             \
+                 + TELEMETRY_VALUE_MAX_LENGTH(type, scale))                                              \
+          : 0))
+
+#define TELEMETRY_CHANNEL_KEY_LENGTH(prefix, name) (sizeof(prefix "99_" #name) - 1)
+#define TELEMETRY_SENSOR_FIELD_MAX_LENGTH(id, name, type, kind, quoted, scale) \
+  +TELEMETRY_FIELD_MAX_LENGTH(TELEMETRY_CHANNEL_KEY_LENGTH(PAYLOAD_SENSOR_KEY_PREFIX, name), type, kind, quoted, scale)
+#define TELEMETRY_FAN_FIELD_MAX_LENGTH(id, name, type, kind, quoted, scale) \
+  +TELEMETRY_FIELD_MAX_LENGTH(TELEMETRY_CHANNEL_KEY_LENGTH(PAYLOAD_FAN_KEY_PREFIX, name), type, kind, quoted, scale)
+#define TELEMETRY_CONTROLLER_FIELD_MAX_LENGTH(id, name, type, kind, quoted, scale) \
+  +TELEMETRY_FIELD_MAX_LENGTH(sizeof(#name) - 1, type, kind, quoted, scale)
+
+#define TELEMETRY_SAMPLE_HEADER_MAX_LENGTH                               \
+  (sizeof("{ \"msgCount\": ") - 1 + 10 + sizeof(", \"ts\": ") - 1 + 10 \
+   + sizeof(", \"frames\": ") - 1 + 5)
+
+// Upper bound of one serialized sample with every channel present: header,
+// capture time, frame count, every field, the keyframe marker and the
+// closing brace.
+#define TELEMETRY_SAMPLE_MAX_LENGTH                                                \
+  (TELEMETRY_SAMPLE_HEADER_MAX_LENGTH                                              \
+   + PAYLOAD_MAX_SENSORS * (0 SENSOR_CHANNEL_FIELDS(TELEMETRY_SENSOR_FIELD_MAX_LENGTH)) \
+   + PAYLOAD_MAX_FANS * (0 FAN_CHANNEL_FIELDS(TELEMETRY_FAN_FIELD_MAX_LENGTH))      \
+   + (0 CONTROLLER_FIELDS(TELEMETRY_CONTROLLER_FIELD_MAX_LENGTH))                   \
+   + sizeof(", \"keyframe\": true") - 1 + sizeof(" }") - 1)
+
+// Messages are streamed through a static chunk of this size, flushed
+// whenever less than TELEMETRY_CHUNK_RESERVE bytes, the bound of any
+// single field or sample header, are left.
+#define TELEMETRY_CHUNK_LENGTH 256
+#define TELEMETRY_CHUNK_RESERVE 128
+
+// Reference values for delta reporting. Work on a copy while building a
+// message and keep it only once the message was published.
+typedef struct {
+  int32_t last_reported[PAYLOAD_SLOT_COUNT];
+  uint8_t sensor_count;  // channels of the reference
+  uint8_t fan_count;
+  uint32_t samples_since_keyframe;
+  bool has_reference;
+} telemetry_delta_state;
+
+void telemetry_delta_reset(telemetry_delta_state *state);
+void telemetry_delta_configure(uint32_t samples_per_keyframe, int32_t deadband_temperature,
+                               int32_t deadband_humidity, int32_t deadband_co2);
+bool telemetry_delta_next_mask(telemetry_delta_state *state, const payload_structure *payload, payload_slot_mask *mask);
+
+// Where telemetry_stream_batch() takes its samples from, sample_queue_peek()
+// on the device; returns false once index is past the last sample.
+typedef bool (*telemetry_sample_source)(size_t index, telemetry_sample *sample);
+
+// Receives the serialized message chunk by chunk; returns false to abort.
+typedef bool (*telemetry_chunk_sink)(const uint8_t *data, size_t length);
+
+size_t telemetry_stream_batch(telemetry_sample_source source, size_t max_samples, uint32_t first_sequence,
+                              telemetry_delta_state *delta, telemetry_chunk_sink sink, size_t *length);
+
+// Encodings of messages with more than one sample, see TELEMETRY_BATCH_ENCODING
+typedef enum {
+  TELEMETRY_ENCODING_JSON,
+  TELEMETRY_ENCODING_DELTA_VARINT,
+} telemetry_encoding;
+
+// Packed batch, content-encoding TELEMETRY_PACKED_CONTENT_ENCODING: a version
+// byte, the msgCount of the first sample as a varint, then every sample
+// until the end of the message:
+//   timestamp        zigzag varint, difference to the previous sample's
+//   frame count      varint
+//   sensor count, fan count, one byte each
+//   every field present, in serial frame order: zigzag varint of the raw
+//   value minus the same slot of the previous sample; the plain value for
+//   the first sample and after the channel counts changed. Measurements of
+//   windows of more than one frame follow with zigzag(min - value) and
+//   zigzag(max - value).
+// Varints are little-endian base 128; zigzag maps 0, -1, 1, -2 to 0, 1, 2, 3.
+// Lossless: deadbands and keyframes do not apply.
+#define TELEMETRY_PACKED_VERSION 1
+#define TELEMETRY_PACKED_CONTENT_TYPE "application%2Foctet-stream"
+#define TELEMETRY_PACKED_CONTENT_ENCODING "x-delta-varint"
+
+size_t telemetry_stream_packed(telemetry_sample_source source, size_t max_samples, uint32_t first_sequence,
+                               telemetry_chunk_sink sink, size_t *length);
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <Arduino.h>
+
+// Wall clock kept across deep sleep. SNTP sets the system clock in the
+// background; before a deep sleep the clock is saved with the length of the
+// sleep, and restored at the next wake from that estimate. The sleep timer
+// runs off the RTC oscillator, which is off by up to several percent, so
+// every SNTP sync after a sleep measures its error and corrects the next
+// sleeps: the requested sleep is scaled so the actual sleep is on time.
+
+#define TIME_BASE_MIN_VALID_EPOCH_SECS 1510592825
+#define TIME_BASE_MIN_DRIFT_WINDOW_MS 300000  // sleep needed before a sync updates the drift
+#define TIME_BASE_MAX_SLEEP_PPM 100000        // bound of the sleep timer correction
+
+// Kept in RTC memory across a deep sleep
+typedef struct {
+  uint32_t seconds;       // expected seconds since epoch at the next wake, 0 if unknown
+  uint32_t milliseconds;  // and the fraction, 0..999
+  int32_t sleep_ppm;      // measured error of the sleep timer, positive if it sleeps long
+  uint32_t slept_ms;      // sleep since the last SNTP sync
+} time_base_rtc;
+
+void time_base_begin();
+void time_base_restore(const time_base_rtc *saved);
+uint32_t time_base_prepare_sleep(time_base_rtc *saved, uint32_t sleep_ms);
+bool time_base_valid();
+bool time_base_estimated();
+uint32_t time_base_now();
+int32_t time_base_sleep_ppm();
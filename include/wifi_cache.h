@@ -0,0 +1,31 @@
+#pragma once
+
+#include <Arduino.h>
+#include <deep_sleep.h>
+
+// Last good association, kept in RTC user memory right after the deep-sleep
+// image so it survives resets and deep sleep. With it the station joins the
+// access point directly, on a known channel and with the address of the last
+// DHCP lease, skipping the scan and DHCP. Lost on power-on; the next full
+// scan fills it in again. The address is only reused WIFI_CACHE_MAX_USES
+// times, about four hours of connect wakes with the deep-sleep defaults,
+// well inside a typical lease; then a normal join renews it with the DHCP
+// server, so a lease that expired or moved is not kept as a static IP.
+
+#define WIFI_CACHE_RTC_OFFSET (DEEP_SLEEP_RTC_OFFSET + DEEP_SLEEP_RTC_BYTES / 4)  // in 4 byte blocks
+#ifndef WIFI_CACHE_MAX_USES
+#define WIFI_CACHE_MAX_USES 24
+#endif
+
+typedef struct {
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip;
+  uint32_t gateway;
+  uint32_t subnet;
+  uint32_t dns;
+} wifi_lease;
+
+bool wifi_cache_load(const char *ssid, wifi_lease *lease);
+void wifi_cache_save(const char *ssid, const wifi_lease *lease);
+void wifi_cache_clear();
@@ -0,0 +1,55 @@
+#include <Arduino.h>
+
+#include <chrono>
+#include <thread>
+
+HostSerial Serial;
+EspClass ESP;
+
+static std::chrono::steady_clock::time_point startTime() {
+  static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  return start;
+}
+
+static uint64_t elapsedNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime()).count();
+}
+
+unsigned long millis() { return (unsigned long)(elapsedNs() / 1000000); }
+unsigned long micros() { return (unsigned long)(elapsedNs() / 1000); }
+void delay(unsigned long ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+void yield() {}
+
+uint32_t EspClass::getCycleCount() { return (uint32_t)elapsedNs(); }
+
+size_t Print::write(const uint8_t *buffer, size_t size) {
+  size_t n = 0;
+  while (size--) {
+    n += write(*buffer++);
+  }
+  return n;
+}
+
+size_t Print::print(long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", value);
+  return print(text);
+}
+
+size_t Print::print(unsigned long value) {
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", value);
+  return print(text);
+}
+
+int HostSerial::read() {
+  if (rx_pos >= rx.size()) {
+    return -1;
+  }
+  int c = (uint8_t)rx[rx_pos++];
+  if (rx_pos == rx.size()) {
+    rx.clear();
+    rx_pos = 0;
+  }
+  return c;
+}
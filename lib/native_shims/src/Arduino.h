@@ -0,0 +1,86 @@
+#pragma once
+
+// Host stand-in for the few parts of the Arduino/ESP8266 core that the
+// parsing and serialization code uses. Only built in [env:native].
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+typedef uint8_t byte;
+
+#define LOW 0
+#define HIGH 1
+#define OUTPUT 1
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void yield();
+
+class Print {
+ public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+
+  size_t print(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(long value);
+  size_t print(unsigned long value);
+  size_t print(int value) { return print((long)value); }
+  size_t print(unsigned int value) { return print((unsigned long)value); }
+
+  template <typename T>
+  size_t println(T value) { return print(value) + println(); }
+  size_t println() { return print("\r\n"); }
+};
+
+// Serial replacement: reads come from a byte queue filled with feed(),
+// writes go to stdout.
+class HostSerial : public Print {
+ public:
+  void begin(unsigned long) {}
+  size_t setRxBufferSize(size_t size) { return size; }
+  bool hasOverrun() { return false; }
+  bool hasRxError() { return false; }
+  void feed(const uint8_t *data, size_t length) { rx.append((const char *)data, length); }
+  void feed(const char *data) { feed((const uint8_t *)data, strlen(data)); }
+  int available() { return (int)(rx.size() - rx_pos); }
+  int read();
+  int availableForWrite() { return 128; }
+
+  size_t write(uint8_t c) override { return fwrite(&c, 1, 1, stdout); }
+  size_t write(const uint8_t *buffer, size_t size) override { return fwrite(buffer, 1, size, stdout); }
+  using Print::write;
+
+ private:
+  std::string rx;
+  size_t rx_pos = 0;
+};
+
+extern HostSerial Serial;
+
+class String {
+ public:
+  String(const char *s = "") : value(s) {}
+  const char *c_str() const { return value.c_str(); }
+  unsigned int length() const { return (unsigned int)value.size(); }
+
+ private:
+  std::string value;
+};
+
+// Cycle counter backed by the monotonic clock in nanoseconds, reported as a
+// 1000 MHz CPU so profiler figures come out in real microseconds.
+class EspClass {
+ public:
+  uint32_t getCycleCount();
+  uint32_t getCpuFreqMHz() { return 1000; }
+};
+
+extern EspClass ESP;
@@ -0,0 +1,155 @@
+#include <adaptive_rate.h>
+#include <device_config.h>
+
+// Where a measurement last moved past its deadband, and when
+typedef struct {
+  int32_t value;
+  uint32_t since_ms;
+} rate_anchor;
+
+typedef struct {
+  rate_anchor anchors[PAYLOAD_SLOT_COUNT];
+  uint8_t sensor_count;  // channels the anchors belong to
+  uint8_t fan_count;
+  bool has_anchors;
+  bool moving;           // dropped to the minimum and not calmed down since
+  bool publish_failed;
+  uint32_t interval_ms;
+} adaptive_rate_state;
+
+typedef enum {
+  RATE_CALM,
+  RATE_HOLD,  // below the threshold, but not yet below the calm level
+  RATE_FAST,
+} rate_level;
+
+static adaptive_rate_state rate;
+
+static uint32_t clampInterval(uint32_t interval_ms, const device_config *config) {
+  uint32_t min_ms = (uint32_t)config->telemetry_interval_min_ms;
+  uint32_t max_ms = (uint32_t)config->telemetry_interval_max_ms;
+
+  if (max_ms < min_ms) {
+    max_ms = min_ms;
+  }
+  if (interval_ms < min_ms) {
+    return min_ms;
+  }
+  return interval_ms > max_ms ? max_ms : interval_ms;
+}
+
+// Back to the configured base interval, e.g. after a configuration change.
+// Returns that interval.
+uint32_t adaptive_rate_reset() {
+  rate.has_anchors = false;
+  rate.moving = false;
+  rate.publish_failed = false;
+  rate.interval_ms = clampInterval((uint32_t)device_config_get()->telemetry_interval_ms, device_config_get());
+  return rate.interval_ms;
+}
+
+void adaptive_rate_publish_result(bool published) {
+  rate.publish_failed = rate.publish_failed || !published;
+}
+
+// Rate of one measurement, in raw units per minute, measured from its anchor
+// rather than from the previous sample. Changes within the delta deadband
+// are sensor noise: they never count as fast and leave the anchor where it
+// is, so noise averages out over time while a slow drift still adds up
+// until it crosses the deadband. Elapsed times come from wraparound safe
+// millis() arithmetic.
+static rate_level fieldLevel(rate_anchor *anchor, int32_t value, uint32_t now_ms, int32_t deadband,
+                             int32_t threshold_per_minute) {
+  int64_t change = (int64_t)value - anchor->value;
+  uint32_t elapsed_ms = now_ms - anchor->since_ms;
+  bool outside_deadband = change > deadband || change < -deadband;
+
+  if (change < 0) {
+    change = -change;
+  }
+  int64_t per_minute = elapsed_ms > 0 ? change * 60000 / elapsed_ms : 0;
+  if (outside_deadband) {
+    anchor->value = value;
+    anchor->since_ms = now_ms;
+  }
+
+  if (outside_deadband && per_minute >= threshold_per_minute) {
+    return RATE_FAST;
+  }
+  return per_minute >= (int64_t)threshold_per_minute * ADAPTIVE_RATE_CALM_PERCENT / 100 ? RATE_HOLD : RATE_CALM;
+}
+
+static void resetAnchors(const payload_structure *sample, uint32_t now_ms) {
+  payload_cursor cursor;
+
+  for (bool more = payload_begin(sample, &cursor); more; more = payload_next(sample, &cursor)) {
+    rate.anchors[cursor.slot].value = payload_get(sample, &cursor);
+    rate.anchors[cursor.slot].since_ms = now_ms;
+  }
+  rate.sensor_count = sample->sensor_count;
+  rate.fan_count = sample->fan_count;
+  rate.has_anchors = true;
+}
+
+// The fastest moving CO2 or temperature reading decides
+static rate_level readingsLevel(const payload_structure *sample, uint32_t now_ms, const device_config *config) {
+  payload_cursor cursor;
+  rate_level level = RATE_CALM;
+
+  // Channels came or went; no rate to compare
+  if (!rate.has_anchors || rate.sensor_count != sample->sensor_count || rate.fan_count != sample->fan_count) {
+    resetAnchors(sample, now_ms);
+    return RATE_CALM;
+  }
+
+  for (bool more = payload_begin(sample, &cursor); more; more = payload_next(sample, &cursor)) {
+    int32_t threshold;
+    int32_t deadband;
+    switch (payload_field(&cursor)->kind) {
+      case FIELD_KIND_CO2:
+        threshold = config->rate_threshold_co2;
+        deadband = config->deadband_co2;
+        break;
+      case FIELD_KIND_TEMPERATURE:
+        threshold = config->rate_threshold_temperature;
+        deadband = config->deadband_temperature;
+        break;
+      default: continue;
+    }
+    rate_level field_level = fieldLevel(&rate.anchors[cursor.slot], payload_get(sample, &cursor), now_ms, deadband,
+                                        threshold);
+    if (field_level > level) {
+      level = field_level;
+    }
+  }
+  return level;
+}
+
+// Called once per captured sample; returns the interval until the next one.
+uint32_t adaptive_rate_next_interval(const payload_structure *sample, uint32_t now_ms, int32_t rssi_dbm) {
+  const device_config *config = device_config_get();
+  uint32_t interval_ms = rate.interval_ms;
+  rate_level level = readingsLevel(sample, now_ms, config);
+
+  // Hysteresis: the interval drops at the rate threshold but only starts
+  // relaxing again once the readings fell below the calm level
+  if (level == RATE_FAST) {
+    interval_ms = 0;
+    rate.moving = true;
+  } else if (level == RATE_HOLD && rate.moving) {
+    // Keep the interval
+  } else {
+    rate.moving = false;
+    interval_ms += interval_ms * ADAPTIVE_RATE_RELAX_PERCENT / 100;
+  }
+
+  bool congested = rate.publish_failed || (rssi_dbm != 0 && rssi_dbm < TELEMETRY_CONGESTED_RSSI_DBM);
+  if (congested) {
+    uint32_t base_ms = (uint32_t)config->telemetry_interval_ms;
+    interval_ms = 2 * (interval_ms > base_ms ? interval_ms : base_ms);
+  }
+
+  rate.publish_failed = false;
+  rate.interval_ms = clampInterval(interval_ms, config);
+  return rate.interval_ms;
+}
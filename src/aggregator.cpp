@@ -0,0 +1,73 @@
+#include <aggregator.h>
+
+typedef struct {
+  int32_t min[PAYLOAD_SLOT_COUNT];
+  int32_t max[PAYLOAD_SLOT_COUNT];
+  int64_t sum[PAYLOAD_SLOT_COUNT];
+  uint8_t sensor_count;  // channels of the frames in this window
+  uint8_t fan_count;
+  uint32_t frame_count;
+} aggregator_window;
+
+static aggregator_window window;
+
+void aggregator_add(const payload_structure *frame) {
+  payload_cursor cursor;
+
+  if (window.sensor_count != frame->sensor_count || window.fan_count != frame->fan_count) {
+    window.sensor_count = frame->sensor_count;
+    window.fan_count = frame->fan_count;
+    window.frame_count = 0;
+  }
+  bool first = window.frame_count == 0;
+
+  for (bool more = payload_begin(frame, &cursor); more; more = payload_next(frame, &cursor)) {
+    if (!PAYLOAD_KIND_IS_MEASUREMENT(payload_field(&cursor)->kind)) {
+      continue;
+    }
+    int32_t value = payload_get(frame, &cursor);
+    if (first || value < window.min[cursor.slot]) {
+      window.min[cursor.slot] = value;
+    }
+    if (first || value > window.max[cursor.slot]) {
+      window.max[cursor.slot] = value;
+    }
+    window.sum[cursor.slot] = (first ? 0 : window.sum[cursor.slot]) + value;
+  }
+
+  window.frame_count++;
+}
+
+// Frames in the current window
+uint32_t aggregator_frame_count() {
+  return window.frame_count;
+}
+
+// Mean rounded half away from zero
+static int32_t roundedMean(int64_t sum, uint32_t count) {
+  return (int32_t)(sum >= 0 ? (sum + count / 2) / count : -((-sum + count / 2) / count));
+}
+
+// Closes the window into sample and starts the next one. sample->payload
+// comes in holding the most recent frame; it supplies the non-measurement
+// fields, and everything if no frame arrived during the window.
+void aggregator_take(telemetry_sample *sample) {
+  const payload_structure *last = &sample->payload;
+  payload_cursor cursor;
+
+  sample->payload_min = *last;
+  sample->payload_max = *last;
+  sample->frame_count = window.frame_count > UINT16_MAX ? UINT16_MAX : (uint16_t)window.frame_count;
+
+  if (window.frame_count > 0 && window.sensor_count == last->sensor_count && window.fan_count == last->fan_count) {
+    for (bool more = payload_begin(last, &cursor); more; more = payload_next(last, &cursor)) {
+      if (PAYLOAD_KIND_IS_MEASUREMENT(payload_field(&cursor)->kind)) {
+        payload_set(&sample->payload, &cursor, roundedMean(window.sum[cursor.slot], window.frame_count));
+        payload_set(&sample->payload_min, &cursor, window.min[cursor.slot]);
+        payload_set(&sample->payload_max, &cursor, window.max[cursor.slot]);
+      }
+    }
+  }
+
+  window.frame_count = 0;
+}
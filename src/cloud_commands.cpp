@@ -0,0 +1,186 @@
+#include <cloud_commands.h>
+#include <processing_functions.h>
+
+typedef enum {
+  COMMAND_TARGET_MCU,                 // forwarded as a set command for `slot`
+  COMMAND_TARGET_TELEMETRY_INTERVAL,  // applied through interval_handler
+} command_target;
+
+// Fields the cloud may set, on every channel of their group
+typedef struct {
+  payload_group group;
+  uint8_t field;
+  int32_t min;
+  int32_t max;
+} writable_field;
+
+static const writable_field writable_fields[] = {
+  { PAYLOAD_GROUP_FAN, FAN_FIELD_SET_PERCENT, 0, 100 },
+  { PAYLOAD_GROUP_CONTROLLER, CONTROLLER_FIELD_PWM_LIGHT, 0, 100 },
+  { PAYLOAD_GROUP_CONTROLLER, CONTROLLER_FIELD_RELAY_CO2, 0, 1 },
+  { PAYLOAD_GROUP_CONTROLLER, CONTROLLER_FIELD_RELAY_PROGRAMMABLE_1, 0, 1 },
+  { PAYLOAD_GROUP_CONTROLLER, CONTROLLER_FIELD_RELAY_PROGRAMMABLE_2, 0, 1 },
+};
+
+#define WRITABLE_FIELD_COUNT (sizeof(writable_fields) / sizeof(writable_fields[0]))
+
+// A key resolved to what it controls
+typedef struct {
+  command_target target;
+  payload_slot slot;
+  int32_t min;
+  int32_t max;
+} command_entry;
+
+static cloud_command_stats stats;
+static telemetry_interval_handler interval_handler = NULL;
+
+void cloud_commands_set_interval_handler(telemetry_interval_handler handler) {
+  interval_handler = handler;
+}
+
+// Channels the MCU reported last, the only ones a key may name
+static uint8_t live_sensor_count = 0;
+static uint8_t live_fan_count = 0;
+
+static bool channelPresent(const payload_cursor *cursor) {
+  switch (cursor->group) {
+    case PAYLOAD_GROUP_SENSOR: return cursor->channel < live_sensor_count;
+    case PAYLOAD_GROUP_FAN: return cursor->channel < live_fan_count;
+    default: return true;
+  }
+}
+
+// Field keys are "fan_<n>_set_percent", "relay_CO2", ..., as in telemetry.
+// A writable field on a channel the MCU does not have is known but absent.
+static bool findCommand(const az_json_token *key, command_entry *command, bool *absent) {
+  payload_cursor cursor;
+
+  *absent = false;
+  if (az_json_token_is_text_equal(key, AZ_SPAN_FROM_STR("telemetry_interval_ms"))) {
+    *command = { COMMAND_TARGET_TELEMETRY_INTERVAL, 0, CLOUD_COMMAND_INTERVAL_MIN_MS, CLOUD_COMMAND_INTERVAL_MAX_MS };
+    return true;
+  }
+  if (!payload_find(key->slice, &cursor)) {
+    return false;
+  }
+  *absent = !channelPresent(&cursor);
+  for (size_t i = 0; i < WRITABLE_FIELD_COUNT; i++) {
+    if (writable_fields[i].group == cursor.group && writable_fields[i].field == cursor.field) {
+      *command = { COMMAND_TARGET_MCU, cursor.slot, writable_fields[i].min, writable_fields[i].max };
+      return true;
+    }
+  }
+  return false;
+}
+
+// Numbers are taken as is, booleans as 0/1 (relays)
+static bool tokenValue(const az_json_token *token, int32_t *value) {
+  switch (token->kind) {
+    case AZ_JSON_TOKEN_NUMBER: return az_result_succeeded(az_json_token_get_int32(token, value));
+    case AZ_JSON_TOKEN_TRUE: *value = 1; return true;
+    case AZ_JSON_TOKEN_FALSE: *value = 0; return true;
+    default: return false;
+  }
+}
+
+static cloud_command_result apply(const command_entry *command, int32_t value) {
+  switch (command->target) {
+    case COMMAND_TARGET_MCU:
+      return serial_queue_command(command->slot, value) ? CLOUD_COMMAND_OK : CLOUD_COMMAND_ERROR_BUSY;
+    case COMMAND_TARGET_TELEMETRY_INTERVAL:
+      if (interval_handler != NULL) {
+        interval_handler((uint32_t)value);
+      }
+      return CLOUD_COMMAND_OK;
+  }
+  return CLOUD_COMMAND_OK;
+}
+
+// One walk over the object. With apply_commands false it only validates and
+// counts the commands that need a new entry in the MCU queue, so a bad value
+// anywhere, or more of them than the queue has room for, rejects the whole
+// message before anything ran. Settings for a slot already queued only
+// replace its value and are not counted; a key repeated within the message
+// is counted every time, erring on the side of BUSY.
+static cloud_command_result walk(az_span message, bool apply_commands, size_t *mcu_commands) {
+  az_json_reader reader;
+
+  if (az_result_failed(az_json_reader_init(&reader, message, NULL))
+      || az_result_failed(az_json_reader_next_token(&reader))
+      || reader.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT) {
+    return CLOUD_COMMAND_ERROR_JSON;
+  }
+
+  while (az_result_succeeded(az_json_reader_next_token(&reader))) {
+    if (reader.token.kind == AZ_JSON_TOKEN_END_OBJECT) {
+      return CLOUD_COMMAND_OK;
+    }
+    if (reader.token.kind != AZ_JSON_TOKEN_PROPERTY_NAME) {
+      return CLOUD_COMMAND_ERROR_JSON;
+    }
+
+    command_entry command;
+    bool absent;
+    bool known = findCommand(&reader.token, &command, &absent);
+    if (az_result_failed(az_json_reader_next_token(&reader))) {
+      return CLOUD_COMMAND_ERROR_JSON;
+    }
+    if (known && absent) {
+      return CLOUD_COMMAND_ERROR_CHANNEL;
+    }
+    if (!known) {
+      if (!apply_commands) {
+        stats.unknown_keys++;
+      }
+      if (az_result_failed(az_json_reader_skip_children(&reader))) {
+        return CLOUD_COMMAND_ERROR_JSON;
+      }
+      continue;
+    }
+
+    int32_t value;
+    if (!tokenValue(&reader.token, &value) || value < command.min || value > command.max) {
+      return CLOUD_COMMAND_ERROR_VALUE;
+    }
+    if (apply_commands) {
+      cloud_command_result result = apply(&command, value);
+      if (result != CLOUD_COMMAND_OK) {
+        return result;
+      }
+    } else if (command.target == COMMAND_TARGET_MCU && !serial_command_queued(command.slot)) {
+      (*mcu_commands)++;
+    }
+  }
+  return CLOUD_COMMAND_ERROR_JSON;
+}
+
+// Parses and applies one C2D message in place, without allocating, against
+// the channels of the latest frame.
+cloud_command_result cloud_commands_process(az_span message, uint8_t sensor_count, uint8_t fan_count) {
+  stats.received++;
+  live_sensor_count = sensor_count;
+  live_fan_count = fan_count;
+
+  size_t mcu_commands = 0;
+  cloud_command_result result = walk(message, false, &mcu_commands);
+  if (result == CLOUD_COMMAND_OK && mcu_commands > serial_command_space()) {
+    result = CLOUD_COMMAND_ERROR_BUSY;
+  }
+  if (result == CLOUD_COMMAND_OK) {
+    result = walk(message, true, &mcu_commands);
+  }
+
+  switch (result) {
+    case CLOUD_COMMAND_OK: stats.applied++; break;
+    case CLOUD_COMMAND_ERROR_JSON: stats.errors_json++; break;
+    case CLOUD_COMMAND_ERROR_VALUE: stats.errors_value++; break;
+    case CLOUD_COMMAND_ERROR_BUSY: stats.errors_busy++; break;
+    case CLOUD_COMMAND_ERROR_CHANNEL: stats.errors_channel++; break;
+  }
+  return result;
+}
+
+const cloud_command_stats *cloud_commands_get_stats() {
+  return &stats;
+}
@@ -0,0 +1,138 @@
+#include <deep_sleep.h>
+
+#include <config.h>
+#include <serial_protocol.h>
+#include <stddef.h>
+
+#define RTC_IMAGE_MAGIC 0x31534450  // "PDS1"
+
+// Record: length (u8), timestamp (u32), frame count (u16), packed mean
+#define RECORD_HEADER_LENGTH (1 + 4 + 2)
+#define RTC_IMAGE_HEADER_LENGTH (12 + 4 + sizeof(time_base_rtc))
+
+typedef struct {
+  uint32_t magic;
+  uint16_t crc;          // CRC16 of everything after it
+  uint16_t used;         // bytes of records
+  uint8_t count;
+  uint8_t wakes;         // since the last publish
+  uint8_t last_length;   // of the newest record, the expected size of the next one
+  uint8_t reserved;
+  uint32_t sequence;     // msgCount of the next sample published
+  time_base_rtc clock;
+  uint8_t records[DEEP_SLEEP_RTC_BYTES - RTC_IMAGE_HEADER_LENGTH];
+} rtc_image;
+
+static_assert(sizeof(rtc_image) == DEEP_SLEEP_RTC_BYTES, "RTC image has padding");
+static_assert(DEEP_SLEEP_RTC_OFFSET * 4 + DEEP_SLEEP_RTC_BYTES <= 512, "RTC image exceeds the user memory");
+static_assert(RECORD_HEADER_LENGTH + PAYLOAD_PACKED_MAX_LENGTH <= sizeof(((rtc_image *)0)->records),
+              "RTC memory cannot hold a sample with every channel");
+static_assert(RECORD_HEADER_LENGTH + PAYLOAD_PACKED_MAX_LENGTH <= UINT8_MAX, "record length is a single byte");
+
+static rtc_image image;
+
+static uint16_t imageCrc() {
+  size_t start = offsetof(rtc_image, used);
+  return crc16_ccitt((const uint8_t *)&image + start, sizeof(image) - start);
+}
+
+static size_t freeBytes() {
+  return sizeof(image.records) - image.used;
+}
+
+static void dropOldest() {
+  size_t length = image.records[0];
+  memmove(image.records, image.records + length, image.used - length);
+  image.used -= length;
+  image.count--;
+}
+
+// Loads the image kept across deep sleep and sets the clock from it; false,
+// with an empty store, after a power-on or if the image does not check out.
+bool deep_sleep_restore() {
+  bool valid = ESP.rtcUserMemoryRead(DEEP_SLEEP_RTC_OFFSET, (uint32_t *)&image, sizeof(image))
+               && image.magic == RTC_IMAGE_MAGIC && image.crc == imageCrc() && image.used <= sizeof(image.records);
+  if (!valid) {
+    memset(&image, 0, sizeof(image));
+    image.magic = RTC_IMAGE_MAGIC;
+  }
+  time_base_restore(&image.clock);
+  return valid;
+}
+
+// A wake connects every DEEP_SLEEP_WAKES_PER_CONNECT wakes, when the next
+// sample would not fit anymore, and whenever the clock is unknown.
+bool deep_sleep_connect_due() {
+  return image.clock.seconds == 0 || image.wakes + 1 >= DEEP_SLEEP_WAKES_PER_CONNECT || freeBytes() < image.last_length;
+}
+
+// Keeps the window mean of sample; the oldest samples make room if needed.
+void deep_sleep_store(const telemetry_sample *sample) {
+  size_t length = RECORD_HEADER_LENGTH + payload_packed_length(&sample->payload);
+
+  while (freeBytes() < length) {
+    dropOldest();
+  }
+
+  uint8_t *record = image.records + image.used;
+  record[0] = (uint8_t)length;
+  memcpy(record + 1, &sample->timestamp, 4);
+  memcpy(record + 5, &sample->frame_count, 2);
+  payload_pack(&sample->payload, record + RECORD_HEADER_LENGTH);
+  image.used += length;
+  image.count++;
+  image.last_length = (uint8_t)length;
+}
+
+// Index 0 is the oldest sample. Minimum and maximum equal the mean.
+bool deep_sleep_peek(size_t index, telemetry_sample *sample) {
+  if (index >= image.count) {
+    return false;
+  }
+
+  size_t offset = 0;
+  while (index-- > 0) {
+    offset += image.records[offset];
+  }
+  const uint8_t *record = image.records + offset;
+  size_t length = record[0];
+
+  if (length < RECORD_HEADER_LENGTH
+      || payload_unpack(record + RECORD_HEADER_LENGTH, length - RECORD_HEADER_LENGTH, &sample->payload)
+             != length - RECORD_HEADER_LENGTH) {
+    return false;
+  }
+  memcpy(&sample->timestamp, record + 1, 4);
+  memcpy(&sample->frame_count, record + 5, 2);
+  sample->payload_min = sample->payload;
+  sample->payload_max = sample->payload;
+  return true;
+}
+
+size_t deep_sleep_sample_count() {
+  return image.count;
+}
+
+// Empties the store once its samples reached the hub.
+void deep_sleep_published(uint32_t next_sequence) {
+  image.used = 0;
+  image.count = 0;
+  image.wakes = 0;
+  image.sequence = next_sequence;
+}
+
+uint32_t deep_sleep_sequence() {
+  return image.sequence;
+}
+
+// Saves the image with the clock and sleeps for sleep_ms. The radio is only
+// calibrated and powered on wakes that publish.
+void deep_sleep_enter(uint32_t sleep_ms) {
+  if (image.wakes < UINT8_MAX) {
+    image.wakes++;
+  }
+  uint32_t timer_ms = time_base_prepare_sleep(&image.clock, sleep_ms);
+  image.crc = imageCrc();
+  ESP.rtcUserMemoryWrite(DEEP_SLEEP_RTC_OFFSET, (uint32_t *)&image, sizeof(image));
+  ESP.deepSleep((uint64_t)timer_ms * 1000, deep_sleep_connect_due() ? WAKE_RF_DEFAULT : WAKE_RF_DISABLED);
+}
@@ -0,0 +1,194 @@
+#include <device_config.h>
+
+static device_config current = {
+#define CONFIG_DEFAULT(id, name, def, min, max) def,
+  DEVICE_CONFIG_FIELDS(CONFIG_DEFAULT)
+#undef CONFIG_DEFAULT
+};
+
+static const int32_t config_min[DEVICE_CONFIG_COUNT] = {
+#define CONFIG_MIN(id, name, def, min, max) min,
+  DEVICE_CONFIG_FIELDS(CONFIG_MIN)
+#undef CONFIG_MIN
+};
+
+static const int32_t config_max[DEVICE_CONFIG_COUNT] = {
+#define CONFIG_MAX(id, name, def, min, max) max,
+  DEVICE_CONFIG_FIELDS(CONFIG_MAX)
+#undef CONFIG_MAX
+};
+
+static const az_span config_name[DEVICE_CONFIG_COUNT] = {
+#define CONFIG_NAME(id, name, def, min, max) AZ_SPAN_LITERAL_FROM_STR(#name),
+  DEVICE_CONFIG_FIELDS(CONFIG_NAME)
+#undef CONFIG_NAME
+};
+
+// What the hub has acknowledged as reported, and the report in flight
+static int32_t reported[DEVICE_CONFIG_COUNT];
+static uint32_t reported_known = 0;
+static int32_t in_flight[DEVICE_CONFIG_COUNT];
+static uint32_t in_flight_mask = 0;
+
+static int32_t *configValue(device_config_id id) {
+  switch (id) {
+#define CONFIG_VALUE(id, name, def, min, max) \
+    case id: return &current.name;
+    DEVICE_CONFIG_FIELDS(CONFIG_VALUE)
+#undef CONFIG_VALUE
+    default: return NULL;
+  }
+}
+
+const device_config *device_config_get() {
+  return &current;
+}
+
+// Range checked update; returns true if the value changed
+bool device_config_set(device_config_id id, int32_t value) {
+  int32_t *target = configValue(id);
+
+  if (target == NULL || value < config_min[id] || value > config_max[id] || *target == value) {
+    return false;
+  }
+  *target = value;
+  return true;
+}
+
+static int findConfig(const az_json_token *key) {
+  for (int id = 0; id < DEVICE_CONFIG_COUNT; id++) {
+    if (az_json_token_is_text_equal(key, config_name[id])) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+// Walks the object the reader is positioned on. Known fields with an
+// integer value are either applied (desired) or recorded as reported;
+// anything else, including "$version" and nested objects, is skipped.
+static bool readSection(az_json_reader *reader, bool desired, bool *changed) {
+  if (reader->token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT) {
+    return false;
+  }
+
+  while (az_result_succeeded(az_json_reader_next_token(reader))) {
+    if (reader->token.kind == AZ_JSON_TOKEN_END_OBJECT) {
+      return true;
+    }
+    int id = findConfig(&reader->token);
+    if (az_result_failed(az_json_reader_next_token(reader))) {
+      return false;
+    }
+
+    int32_t value;
+    if (id >= 0 && reader->token.kind == AZ_JSON_TOKEN_NUMBER
+        && az_result_succeeded(az_json_token_get_int32(&reader->token, &value))) {
+      if (desired) {
+        *changed = device_config_set((device_config_id)id, value) || *changed;
+      } else {
+        reported[id] = value;
+        reported_known |= 1UL << id;
+      }
+    } else if (az_result_failed(az_json_reader_skip_children(reader))) {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Handles a twin GET response ({ "desired": {...}, "reported": {...} }) or
+// a desired properties PATCH (the desired object itself). Returns true if
+// the configuration changed.
+bool device_config_process_twin(az_span document, bool is_patch) {
+  az_json_reader reader;
+  bool changed = false;
+
+  if (az_result_failed(az_json_reader_init(&reader, document, NULL))
+      || az_result_failed(az_json_reader_next_token(&reader))) {
+    return false;
+  }
+
+  if (is_patch) {
+    readSection(&reader, true, &changed);
+    return changed;
+  }
+
+  if (reader.token.kind != AZ_JSON_TOKEN_BEGIN_OBJECT) {
+    return false;
+  }
+  // A full document replaces whatever we believed was reported
+  reported_known = 0;
+  while (az_result_succeeded(az_json_reader_next_token(&reader))
+         && reader.token.kind == AZ_JSON_TOKEN_PROPERTY_NAME) {
+    bool is_desired = az_json_token_is_text_equal(&reader.token, AZ_SPAN_FROM_STR("desired"));
+    bool is_reported = az_json_token_is_text_equal(&reader.token, AZ_SPAN_FROM_STR("reported"));
+
+    if (az_result_failed(az_json_reader_next_token(&reader))) {
+      break;
+    }
+    if (is_desired || is_reported) {
+      if (!readSection(&reader, is_desired, &changed)) {
+        break;
+      }
+    } else if (az_result_failed(az_json_reader_skip_children(&reader))) {
+      break;
+    }
+  }
+  return changed;
+}
+
+static uint32_t dirtyMask() {
+  uint32_t mask = 0;
+
+  for (int id = 0; id < DEVICE_CONFIG_COUNT; id++) {
+    if (!(reported_known & (1UL << id)) || reported[id] != *configValue((device_config_id)id)) {
+      mask |= 1UL << id;
+    }
+  }
+  return mask;
+}
+
+// True when something differs from the acknowledged report and no report
+// is waiting for its response
+bool device_config_report_pending() {
+  return in_flight_mask == 0 && dirtyMask() != 0;
+}
+
+// Writes the changed fields as a reported properties patch and remembers
+// them until device_config_report_done(). destination must hold
+// DEVICE_CONFIG_REPORTED_MAX_LENGTH bytes.
+az_span device_config_write_reported(az_span destination) {
+  az_span out = az_span_copy_u8(destination, '{');
+  bool first = true;
+
+  in_flight_mask = dirtyMask();
+  for (int id = 0; id < DEVICE_CONFIG_COUNT; id++) {
+    if (!(in_flight_mask & (1UL << id))) {
+      continue;
+    }
+    in_flight[id] = *configValue((device_config_id)id);
+
+    out = az_span_copy(out, first ? AZ_SPAN_FROM_STR(" \"") : AZ_SPAN_FROM_STR(", \""));
+    out = az_span_copy(out, config_name[id]);
+    out = az_span_copy(out, AZ_SPAN_FROM_STR("\": "));
+    (void)az_span_i32toa(out, in_flight[id], &out);
+    first = false;
+  }
+  return az_span_copy(out, AZ_SPAN_FROM_STR(" }"));
+}
+
+// Response to the report in flight; on failure the fields stay dirty and
+// go out again with the next report. Also call with false when the
+// response can no longer arrive (disconnect).
+void device_config_report_done(bool accepted) {
+  if (accepted) {
+    for (int id = 0; id < DEVICE_CONFIG_COUNT; id++) {
+      if (in_flight_mask & (1UL << id)) {
+        reported[id] = in_flight[id];
+        reported_known |= 1UL << id;
+      }
+    }
+  }
+  in_flight_mask = 0;
+}
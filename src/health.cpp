@@ -0,0 +1,105 @@
+#include <health.h>
+#include <processing_functions.h>
+#include <sample_queue.h>
+#include <scheduler.h>
+
+typedef struct {
+  uint32_t heap_free_min;
+  uint32_t heap_max_block_min;
+  uint8_t heap_fragmentation_max;
+  uint32_t loop_count;
+  uint32_t loop_busy_total_us;
+  uint32_t loop_busy_max_us;
+  uint32_t events[HEALTH_EVENT_COUNT];
+} health_state;
+
+static health_state health = { UINT32_MAX, UINT32_MAX, 0 };
+
+// Called once per loop() with the time spent running tasks (idle excluded).
+void health_record_loop(uint32_t busy_us) {
+  health.loop_count++;
+  health.loop_busy_total_us += busy_us;
+  if (busy_us > health.loop_busy_max_us) {
+    health.loop_busy_max_us = busy_us;
+  }
+}
+
+void health_count(health_event event) {
+  health.events[event]++;
+}
+
+// Tracks heap low-water marks between reports
+void health_sample() {
+  uint32_t heap_free = ESP.getFreeHeap();
+  uint32_t max_block = ESP.getMaxFreeBlockSize();
+  uint8_t fragmentation = ESP.getHeapFragmentation();
+
+  if (heap_free < health.heap_free_min) {
+    health.heap_free_min = heap_free;
+  }
+  if (max_block < health.heap_max_block_min) {
+    health.heap_max_block_min = max_block;
+  }
+  if (fragmentation > health.heap_fragmentation_max) {
+    health.heap_fragmentation_max = fragmentation;
+  }
+}
+
+static az_span writeEntry(az_span out, az_span key_fragment, uint32_t value) {
+  out = az_span_copy(out, key_fragment);
+  (void)az_span_u32toa(out, value, &out);
+  return out;
+}
+
+// Writes the health report as JSON. The window stays open until
+// health_window_reset(), so a report that could not be published is not lost.
+az_span health_write_payload(az_span destination) {
+  const serial_rx_stats *rx = serial_rx_get_stats();
+  const sample_queue_stats *queue = sample_queue_get_stats();
+
+  health_sample();
+
+  az_span out = destination;
+  out = writeEntry(out, AZ_SPAN_FROM_STR("{ \"uptimeSecs\": "), millis() / 1000);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"heapFree\": "), ESP.getFreeHeap());
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"heapFreeMin\": "), health.heap_free_min);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"heapMaxBlockMin\": "), health.heap_max_block_min);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"heapFragmentationMax\": "), health.heap_fragmentation_max);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"stackFreeMin\": "), ESP.getFreeContStack());
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"loopAvgUs\": "),
+                   health.loop_count ? health.loop_busy_total_us / health.loop_count : 0);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"loopMaxUs\": "), health.loop_busy_max_us);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"deadlineMisses\": "), scheduler_total_deadline_misses());
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"wifiConnects\": "), health.events[HEALTH_EVENT_WIFI_CONNECT]);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"mqttConnects\": "), health.events[HEALTH_EVENT_MQTT_CONNECT]);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"mqttDisconnects\": "), health.events[HEALTH_EVENT_MQTT_DISCONNECT]);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"publishFailures\": "), health.events[HEALTH_EVENT_PUBLISH_FAILED]);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"twinGetTimeouts\": "), health.events[HEALTH_EVENT_TWIN_GET_TIMEOUT]);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"rxFrames\": "), rx->frames_ok);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"rxErrors\": "),
+                   rx->frames_too_long + rx->errors_syntax + rx->errors_field_count + rx->errors_overflow + rx->errors_crc);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"rxOverruns\": "), rx->overruns);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"rxLineErrors\": "), rx->line_errors);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"queueDepth\": "), sample_queue_count());
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"queueSpilled\": "), queue->spilled);
+  out = writeEntry(out, AZ_SPAN_FROM_STR(", \"queueDropped\": "), queue->dropped);
+  out = az_span_copy(out, AZ_SPAN_FROM_STR(", "));
+  out = profiler_write_json(out);
+  out = az_span_copy(out, AZ_SPAN_FROM_STR(" }"));
+  return out;
+}
+
+// Starts a new reporting window for the loop timing, heap and stack
+// low-water marks and the profile, once the last report went out.
+void health_window_reset() {
+  health.heap_free_min = UINT32_MAX;
+  health.heap_max_block_min = UINT32_MAX;
+  health.heap_fragmentation_max = 0;
+  health.loop_count = 0;
+  health.loop_busy_total_us = 0;
+  health.loop_busy_max_us = 0;
+  profiler_reset();
+
+  // The core only tracks the continuous stack low-water mark since the last reset
+  ESP.resetFreeContStack();
+}
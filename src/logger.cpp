@@ -0,0 +1,93 @@
+#include <logger.h>
+
+#include <stdarg.h>
+
+static const char level_tags[] = { '-', 'E', 'W', 'I', 'D' };
+
+#if LOG_SINK == LOG_SINK_RING
+
+static char ring[LOG_RING_BYTES];
+static size_t ring_head = 0;  // where the next byte goes
+static bool ring_wrapped = false;
+
+static void sinkWrite(const char *text, size_t length) {
+  while (length > 0) {
+    size_t chunk = length < LOG_RING_BYTES - ring_head ? length : LOG_RING_BYTES - ring_head;
+    memcpy(ring + ring_head, text, chunk);
+    ring_head += chunk;
+    text += chunk;
+    length -= chunk;
+    if (ring_head == LOG_RING_BYTES) {
+      ring_head = 0;
+      ring_wrapped = true;
+    }
+  }
+}
+
+// Prints the ring oldest line first, without the partly overwritten one
+void logger_dump(Print &out) {
+  size_t start = ring_wrapped ? ring_head : 0;
+  size_t count = ring_wrapped ? LOG_RING_BYTES : ring_head;
+  size_t skip = 0;
+
+  if (ring_wrapped) {
+    while (skip < count && ring[(start + skip) % LOG_RING_BYTES] != '\n') {
+      skip++;
+    }
+    skip++;
+  }
+  for (size_t i = skip; i < count; i++) {
+    out.write((uint8_t)ring[(start + i) % LOG_RING_BYTES]);
+  }
+}
+
+void logger_begin() {}
+
+void logger_flush() {}
+
+#else
+
+#if LOG_SINK == LOG_SINK_SERIAL1
+#define LOG_PORT Serial1
+#else
+#define LOG_PORT Serial
+#endif
+
+static void sinkWrite(const char *text, size_t length) {
+  LOG_PORT.write((const uint8_t *)text, length);
+}
+
+void logger_dump(Print &out) {
+  out.println("log is not kept, see LOG_SINK");
+}
+
+// The data UART is opened by serial_begin()
+void logger_begin() {
+#if LOG_SINK == LOG_SINK_SERIAL1
+  Serial1.begin(LOG_SERIAL1_BAUD_RATE);
+#endif
+}
+
+// Waits until everything logged has left the UART, e.g. before a deep sleep
+void logger_flush() {
+  LOG_PORT.flush();
+}
+
+#endif
+
+// Writes one line: uptime in ms, level tag, message. format is in flash.
+void logger_write(uint8_t level, const char *format, ...) {
+  char line[LOG_LINE_MAX_LENGTH];
+  int prefix = snprintf(line, sizeof(line), "%lu %c ", (unsigned long)millis(), level_tags[level]);
+  size_t space = sizeof(line) - prefix - 2;  // room is kept for "\r\n"
+  va_list args;
+
+  va_start(args, format);
+  int message = vsnprintf_P(line + prefix, space, format, args);
+  va_end(args);
+
+  size_t length = prefix + (message < 0 ? 0 : (size_t)message < space ? (size_t)message : space - 1);
+  line[length++] = '\r';
+  line[length++] = '\n';
+  sinkWrite(line, length);
+}
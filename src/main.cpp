@@ -34,10 +34,10 @@
 #include <ESP8266WiFi.h>
 #include <PubSubClient.h>
 #include <WiFiClientSecure.h>
-#include <base64.h>
 #include <bearssl/bearssl.h>
 #include <bearssl/bearssl_hmac.h>
 #include <libb64/cdecode.h>
+#include <libb64/cencode.h>
 
 // Azure IoT SDK for C includes
 #include <az_core.h>
@@ -45,9 +45,24 @@
 #include <azure_ca.h>
 
 // Additional sample headers
+#include <adaptive_rate.h>
+#include <aggregator.h>
+#include <cloud_commands.h>
 #include <config.h>
+#include <deep_sleep.h>
+#include <device_config.h>
+#include <health.h>
+#include <logger.h>
 #include <payload.h>
+#include <payload_buffer.h>
 #include <processing_functions.h>
+#include <profiler.h>
+#include <sample_queue.h>
+#include <scheduler.h>
+#include <soak_bench.h>
+#include <telemetry.h>
+#include <time_base.h>
+#include <wifi_cache.h>
 
 
 
@@ -59,10 +74,67 @@
 
 // Utility macros and defines
 #define LED_PIN 2
+#define LED_ENABLED (LOG_SINK != LOG_SINK_SERIAL1)  // UART1 TX is on the LED pin
 #define sizeofarray(a) (sizeof(a) / sizeof(a[0]))
 #define ONE_HOUR_IN_SECS 3600
+#define SAS_TOKEN_DURATION_SECS ONE_HOUR_IN_SECS
+#define SAS_TOKEN_RENEWAL_MARGIN_SECS 300
+#define SAS_TOKEN_RENEWAL_JITTER_SECS 600
 #define NTP_SERVERS "pool.ntp.org", "time.nist.gov"
+#define TELEMETRY_TOPIC_SIZE 160
+#define MESSAGE_PROPERTIES_SIZE 96
+#define TWIN_TOPIC_SIZE 64
+#define TWIN_GET_REQUEST_ID "get"
+#define TWIN_REPORT_REQUEST_ID "report"
+// Outgoing messages are streamed to the socket with beginPublish()/write(),
+// so PubSubClient's buffer only has to hold the topic when publishing and
+// whole packets when receiving; C2D messages arrive through it.
 #define MQTT_PACKET_SIZE 1024
+#define LED_ON_TIME_MS 100
+
+// TLS tuning. IoT Hub records are requested at TLS_MFLN_SIZE bytes through the
+// max fragment length extension; when the server accepts, the 16 KB default
+// receive buffer shrinks to that size.
+#define TLS_MFLN_SIZE 1024
+#define TLS_TX_BUFFER_SIZE 1024
+
+// Task periods and deadlines, in milliseconds
+#define SERIAL_RX_PERIOD_MS 2
+#define SERIAL_RX_DEADLINE_MS 10
+#define MQTT_LOOP_PERIOD_MS 10
+#define MQTT_LOOP_DEADLINE_MS 50
+#define TELEMETRY_DEADLINE_MS 1000
+#define DRAIN_DEADLINE_MS 1000
+#define LED_PERIOD_MS 20
+#define LED_DEADLINE_MS 50
+#define RECONNECT_PERIOD_MS 100
+#define RECONNECT_DEADLINE_MS 5000
+#define SAS_RENEWAL_PERIOD_MS 10000
+#define SAS_RENEWAL_DEADLINE_MS 10000
+#define HEALTH_SAMPLE_PERIOD_MS 1000
+#define HEALTH_SAMPLE_DEADLINE_MS 1000
+#define HEALTH_REPORT_DEADLINE_MS 10000
+#define TWIN_PERIOD_MS 1000
+#define TWIN_DEADLINE_MS 5000
+#define TWIN_RESPONSE_TIMEOUT_MS 30000
+#define TWIN_GET_RETRY_MS 60000
+
+// Connection state machine timing
+#define WIFI_CONNECT_TIMEOUT_MS 20000
+#define WIFI_CACHED_CONNECT_TIMEOUT_MS 3000
+#define SNTP_SYNC_TIMEOUT_MS 30000
+#define CONNECTION_BACKOFF_MIN_MS 1000
+#define CONNECTION_BACKOFF_MAX_MS 60000
+
+// Deep-sleep wakes
+#define WAKE_TASK_PERIOD_MS 10
+#define WAKE_TASK_DEADLINE_MS 100
+#define WAKE_MIN_SLEEP_MS 1000
+
+// Bench firmware, see soak_bench.h
+#define BENCH_FEED_PERIOD_MS 2
+#define BENCH_FEED_DEADLINE_MS 10
+#define BENCH_REPORT_DEADLINE_MS 10000
 
 
 
@@ -77,60 +149,138 @@ static const int timezone = -3;
 // Memory allocated for the sample's variables and structures.
 static WiFiClientSecure wifi_client;
 static X509List cert((const char *)ca_pem);
+static BearSSL::Session tls_session;
+static bool tls_mfln_probed = false;
 static PubSubClient mqtt_client(wifi_client);
 static az_iot_hub_client client;
 static char sas_token[200];
 static uint8_t signature[512];
 static unsigned char encrypted_signature[32];
 static char base64_decoded_device_key[32];
-static unsigned long next_telemetry_send_time_ms = 0;
-static char telemetry_topic[128];
-static uint8_t telemetry_payload[1024];
+static char b64enc_hmacsha256_signature[48];
+static br_hmac_key_context device_key_context;
+static bool device_key_ready = false;
+static bool sas_token_valid = false;
+static uint32_t sas_token_renew_at = 0;
+static bool led_on = false;
+static bool clients_initialized = false;
+static uint32_t led_off_time_ms = 0;
 static uint32_t telemetry_send_count = 0;
-az_iot_message_properties properties;
+static uint32_t batch_started_ms = 0;
+static telemetry_delta_state delta_state;
+static telemetry_delta_state pending_delta_state;
+static uint8_t health_payload[HEALTH_PAYLOAD_SIZE];
+static uint8_t twin_reported_payload[DEVICE_CONFIG_REPORTED_MAX_LENGTH];
+static bool twin_get_pending = false;
+static bool twin_get_in_flight = false;
+static bool twin_view_known = false;  // the GET was answered or timed out this session
+static uint32_t twin_get_due_ms = 0;
+static uint32_t twin_get_sent_ms = 0;
+static bool twin_report_in_flight = false;
+static uint32_t twin_report_sent_ms = 0;
 az_result result;
-payload_structure payload_data;
+static payload_buffer latest_payload;
 // Auxiliary functions
 
+typedef enum
+{
+  CONNECTION_WIFI_START,
+  CONNECTION_WIFI_WAIT,
+  CONNECTION_TIME_WAIT,
+  CONNECTION_MQTT_CONNECT,
+  CONNECTION_CONNECTED,
+  CONNECTION_BACKOFF,
+} connection_state;
+
+static connection_state conn_state = CONNECTION_WIFI_START;
+static connection_state conn_retry_state = CONNECTION_WIFI_START;
+static uint32_t conn_state_deadline_ms = 0;
+static uint32_t conn_backoff_ms = CONNECTION_BACKOFF_MIN_MS;
+static bool sntp_started = false;
+static bool wifi_cached_attempt = false;
+
+// Deep-sleep batch mode, see DEEP_SLEEP_ENABLED
+static bool wake_connects = false;
+static bool wake_sampled = false;
+
+// Device-to-cloud message kinds. Each has a fixed property set, so its
+// publish topic is built once after the hub client is initialized.
+typedef enum
+{
+  MESSAGE_TYPE_TELEMETRY,
+  MESSAGE_TYPE_BATCH,
+  MESSAGE_TYPE_BATCH_PACKED,
+  MESSAGE_TYPE_HEALTH,
+  MESSAGE_TYPE_COUNT
+} message_type;
+
+static char publish_topics[MESSAGE_TYPE_COUNT][TELEMETRY_TOPIC_SIZE];
+static bool publish_topics_ready = false;
 
 
 
 
 
-static void connectToWiFi()
+
+static void writeLed(int level)
+{
+  if (LED_ENABLED)
+  {
+    digitalWrite(LED_PIN, level);
+  }
+}
+
+/*
+ * @brief           Starts associating, directly with the last good access point
+ *                  and address if they are cached, with a scan and DHCP otherwise
+ *                  and every WIFI_CACHE_MAX_USES joins.
+ * @return uint32_t How long to wait for the association, in milliseconds.
+ */
+static uint32_t startWiFi()
 {
-  Serial.begin(115200);
-  Serial.println();
-  Serial.print("Connecting to WIFI SSID ");
-  Serial.println(ssid);
-  
+  wifi_lease lease;
+
+  LOG_INFO("Connecting to WIFI SSID %s", ssid);
+
+  // Credentials come from config.h, there is no need to rewrite them to flash
+  WiFi.persistent(false);
   WiFi.mode(WIFI_STA);
-  WiFi.disconnect();
-  delay(100);
-  WiFi.begin(ssid, password);
-  while (WiFi.status() != WL_CONNECTED)
+  wifi_cached_attempt = wifi_cache_load(ssid, &lease);
+  if (wifi_cached_attempt)
   {
-    delay(500);
-    Serial.print(".");
+    LOG_INFO("Using cached BSSID, channel and IP address");
+    WiFi.config(IPAddress(lease.ip), IPAddress(lease.gateway), IPAddress(lease.subnet), IPAddress(lease.dns));
+    WiFi.begin(ssid, password, lease.channel, lease.bssid);
+    return WIFI_CACHED_CONNECT_TIMEOUT_MS;
   }
 
-  Serial.print("WiFi connected, IP address: ");
-  Serial.println(WiFi.localIP());
+  // Back to DHCP in case an earlier attempt set the cached address
+  WiFi.config(IPAddress(0u), IPAddress(0u), IPAddress(0u));
+  WiFi.begin(ssid, password);
+  return WIFI_CONNECT_TIMEOUT_MS;
+}
+
+// Remembers the association that just succeeded for the next one
+static void cacheWiFiLease()
+{
+  wifi_lease lease;
+
+  memcpy(lease.bssid, WiFi.BSSID(), sizeof(lease.bssid));
+  lease.channel = (uint8_t)WiFi.channel();
+  lease.ip = (uint32_t)WiFi.localIP();
+  lease.gateway = (uint32_t)WiFi.gatewayIP();
+  lease.subnet = (uint32_t)WiFi.subnetMask();
+  lease.dns = (uint32_t)WiFi.dnsIP();
+  wifi_cache_save(ssid, &lease);
 }
 
-static void initializeTime()
+static bool isTimeValid() { return time_base_valid(); }
+
+static void startTimeSync()
 {
-  Serial.print("Setting time using SNTP");
-  
+  LOG_INFO("Setting time using SNTP");
   configTime(timezone * 3600, 0, NTP_SERVERS);
-  time_t now = time(NULL);
-  while (now < 1510592825)
-  {
-    delay(500);
-    Serial.print(".");
-    now = time(NULL);
-  }
-  Serial.println("done!");
+  sntp_started = true;
 }
 
 static char *getCurrentLocalTimeString()
@@ -141,95 +291,302 @@ static char *getCurrentLocalTimeString()
 
 static void printCurrentTime()
 {
-  Serial.print("Current time: ");
-  Serial.print(getCurrentLocalTimeString());
+  // ctime() ends in a newline
+  LOG_INFO("Current time: %.24s", getCurrentLocalTimeString());
 }
 
+/*
+ * @brief   Pushes the runtime configuration into the modules that use it.
+ */
+static void applyDeviceConfig()
+{
+  const device_config *config = device_config_get();
+  scheduler_task *telemetry_task = scheduler_find("telemetry");
+  uint32_t interval_ms = adaptive_rate_reset();
+
+  if (telemetry_task != NULL)
+  {
+    scheduler_set_period(telemetry_task, interval_ms);
+  }
+  telemetry_delta_configure(
+      config->keyframe_interval, config->deadband_temperature, config->deadband_humidity, config->deadband_co2);
+}
+
+/*
+ * @brief   Twin GET responses and desired property patches update the runtime
+ *          configuration; the response to our reported patch acknowledges it.
+ */
+static void handleTwinMessage(const az_iot_hub_client_twin_response *response, az_span payload)
+{
+  switch (response->response_type)
+  {
+    case AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_GET:
+      twin_get_in_flight = false;
+      twin_view_known = true;
+      if (!az_iot_status_succeeded(response->status))
+      {
+        LOG_WARN("Twin GET failed with status %d, retrying", (int)response->status);
+        twin_get_pending = true;
+        twin_get_due_ms = millis() + TWIN_GET_RETRY_MS;
+        break;
+      }
+      // fall through
+    case AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_DESIRED_PROPERTIES:
+      if (device_config_process_twin(
+              payload, response->response_type == AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_DESIRED_PROPERTIES))
+      {
+        LOG_INFO("Device twin changed the configuration");
+        applyDeviceConfig();
+      }
+      break;
+
+    case AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_TYPE_REPORTED_PROPERTIES:
+      device_config_report_done(az_iot_status_succeeded(response->status));
+      twin_report_in_flight = false;
+      break;
+
+    default:
+      break;
+  }
+}
+
+/*
+ * @brief   C2D messages and twin responses are parsed in place from PubSubClient's
+ *          receive buffer and dispatched from there; nothing is copied or allocated.
+ */
 void receivedCallback(char *topic, byte *payload, unsigned int length)
 {
-  Serial.print("Received [");
-  Serial.print(topic);
-  Serial.print("]: ");
-  for (int i = 0; i < length; i++)
+  az_span topic_span = az_span_create((uint8_t *)topic, strlen(topic));
+  az_iot_hub_client_c2d_request request;
+  az_iot_hub_client_twin_response twin_response;
+
+  if (az_result_succeeded(az_iot_hub_client_twin_parse_received_topic(&client, topic_span, &twin_response)))
+  {
+    handleTwinMessage(&twin_response, az_span_create(payload, length));
+    return;
+  }
+
+  if (az_result_failed(az_iot_hub_client_c2d_parse_received_topic(&client, topic_span, &request)))
+  {
+    LOG_WARN("Ignoring message on %s", topic);
+    return;
+  }
+
+  const payload_structure *latest;
+  uint32_t sequence;
+  uint8_t sensor_count;
+  uint8_t fan_count;
+  do
+  {
+    latest = payload_buffer_read_begin(&latest_payload, &sequence);
+    sensor_count = latest->sensor_count;
+    fan_count = latest->fan_count;
+  } while (!payload_buffer_read_end(&latest_payload, sequence));
+
+  cloud_command_result result = cloud_commands_process(az_span_create(payload, length), sensor_count, fan_count);
+  LOG_INFO("C2D command %s", result == CLOUD_COMMAND_OK ? "applied" : "rejected");
+}
+
+/*
+ * @brief Configures the TLS client once per boot. The trust anchors and the
+ *        session cache live for the lifetime of the firmware, so reconnects
+ *        resume the previous TLS session with an abbreviated handshake
+ *        instead of a full one.
+ */
+static void initializeTls()
+{
+  wifi_client.setTrustAnchors(&cert);
+  wifi_client.setSession(&tls_session);
+}
+
+/*
+ * @brief Asks the hub whether it supports smaller TLS records and shrinks the
+ *        BearSSL buffers if it does. Needs a WiFi connection. The probe is a
+ *        blocking TCP and TLS round trip, so it runs only on the first connect
+ *        attempt of a boot, whatever its outcome; a probe lost to a network
+ *        error keeps the default buffers until the next boot.
+ */
+static void probeTlsFragmentLength()
+{
+  if (tls_mfln_probed)
+  {
+    return;
+  }
+  tls_mfln_probed = true;
+
+  if (wifi_client.probeMaxFragmentLength(host, port, TLS_MFLN_SIZE))
+  {
+    LOG_INFO("TLS MFLN supported, using small buffers");
+    wifi_client.setBufferSizes(TLS_MFLN_SIZE, TLS_TX_BUFFER_SIZE);
+  }
+  else
+  {
+    LOG_INFO("TLS MFLN not confirmed, keeping default buffers until reboot");
+  }
+}
+
+/*
+ * @brief               Builds the application property set of a message type into buffer.
+ * @param[in] type      Message type.
+ * @param[out] props    Property set, backed by buffer.
+ * @param[in] buffer    Storage for the encoded properties.
+ * @return az_result    AZ_OK, or the error of the first property that did not fit.
+ */
+static az_result buildMessageProperties(message_type type, az_iot_message_properties *props, az_span buffer)
+{
+  bool packed = type == MESSAGE_TYPE_BATCH_PACKED;
+  az_result rc = az_iot_message_properties_init(props, buffer, 0);
+  if (az_result_succeeded(rc))
+  {
+    rc = az_iot_message_properties_append(
+        props, AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_TYPE),
+        packed ? AZ_SPAN_FROM_STR(TELEMETRY_PACKED_CONTENT_TYPE) : AZ_SPAN_FROM_STR("application%2Fjson"));
+  }
+  if (az_result_succeeded(rc))
+  {
+    rc = az_iot_message_properties_append(
+        props, AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_ENCODING),
+        packed ? AZ_SPAN_FROM_STR(TELEMETRY_PACKED_CONTENT_ENCODING) : AZ_SPAN_FROM_STR("UTF-8"));
+  }
+  if (az_result_failed(rc))
+  {
+    return rc;
+  }
+
+  switch (type)
+  {
+    case MESSAGE_TYPE_BATCH:
+    case MESSAGE_TYPE_BATCH_PACKED:
+      return az_iot_message_properties_append(props, AZ_SPAN_FROM_STR("msgType"), AZ_SPAN_FROM_STR("batch"));
+    case MESSAGE_TYPE_HEALTH:
+      return az_iot_message_properties_append(props, AZ_SPAN_FROM_STR("msgType"), AZ_SPAN_FROM_STR("health"));
+    default:
+      return AZ_OK;
+  }
+}
+
+/*
+ * @brief   Builds the publish topic of every message type. Topics only depend
+ *          on the device id and the property set, so this runs once per boot.
+ */
+static void initializePublishTopics()
+{
+  uint8_t property_buffer[MESSAGE_PROPERTIES_SIZE];
+  az_iot_message_properties props;
+
+  uint32_t start = profiler_begin();
+  publish_topics_ready = true;
+  for (int type = 0; type < MESSAGE_TYPE_COUNT; type++)
   {
-    Serial.print((char)payload[i]);
+    if (az_result_failed(buildMessageProperties((message_type)type, &props, AZ_SPAN_FROM_BUFFER(property_buffer)))
+        || az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(
+               &client, &props, publish_topics[type], sizeof(publish_topics[type]), NULL)))
+    {
+      LOG_ERROR("Failed az_iot_hub_client_telemetry_get_publish_topic");
+      publish_topics_ready = false;
+    }
   }
-  Serial.println("");
+  profiler_end(PROFILE_PUBLISH_TOPIC, start);
 }
 
-static void initializeClients()
+/*
+ * @brief         Sets up the hub client, the MQTT client and the publish topics.
+ * @return bool   true if all of them are ready; false to retry on the next connect.
+ */
+static bool initializeClients()
 {
   az_iot_hub_client_options options = az_iot_hub_client_options_default();
   options.user_agent = AZ_SPAN_FROM_STR(AZURE_SDK_CLIENT_USER_AGENT);
 
-  wifi_client.setTrustAnchors(&cert);
   if (az_result_failed(az_iot_hub_client_init(
           &client,
           az_span_create((uint8_t *)host, strlen(host)),
           az_span_create((uint8_t *)device_id, strlen(device_id)),
           &options)))
   {
-    Serial.println("Failed initializing Azure IoT Hub client");
-    return;
+    LOG_ERROR("Failed initializing Azure IoT Hub client");
+    return false;
   }
 
   mqtt_client.setServer(host, port);
   mqtt_client.setCallback(receivedCallback);
+
+  initializePublishTopics();
+  return publish_topics_ready;
 }
 
 /*
  * @brief           Gets the number of seconds since UNIX epoch until now.
  * @return uint32_t Number of seconds.
  */
-static uint32_t getSecondsSinceEpoch() { return (uint32_t)time(NULL); }
+static uint32_t getSecondsSinceEpoch() { return time_base_now(); }
 
 
 
 
 
-static int generateSasToken(char *sas_token, size_t size)
+/*
+ * @brief       Decodes the device key and prepares its HMAC key context. The
+ *              result never changes, so this runs once per boot.
+ * @return int  0 on success.
+ */
+static int initializeDeviceKey()
 {
-  az_span signature_span = az_span_create((uint8_t *)signature, sizeofarray(signature));
-  az_span out_signature_span;
-  az_span encrypted_signature_span = az_span_create((uint8_t *)encrypted_signature, sizeofarray(encrypted_signature));
+  if (device_key_ready)
+  {
+    return 0;
+  }
 
-  uint32_t expiration = getSecondsSinceEpoch() + ONE_HOUR_IN_SECS;
+  int base64_decoded_device_key_length = base64_decode_chars(device_key, strlen(device_key), base64_decoded_device_key);
 
-  // Get signature
-  if (az_result_failed(az_iot_hub_client_sas_get_signature(
-          &client, expiration, signature_span, &out_signature_span)))
+  if (base64_decoded_device_key_length == 0)
   {
-    Serial.println("Failed getting SAS signature");
+    LOG_ERROR("Failed base64 decoding device key");
     return 1;
   }
 
+  br_hmac_key_init(
+      &device_key_context, &br_sha256_vtable, base64_decoded_device_key, base64_decoded_device_key_length);
+  device_key_ready = true;
+  return 0;
+}
 
+static int generateSasToken(char *sas_token, size_t size)
+{
+  az_span signature_span = az_span_create((uint8_t *)signature, sizeofarray(signature));
+  az_span out_signature_span;
 
+  if (initializeDeviceKey() != 0)
+  {
+    return 1;
+  }
 
-  // Base64-decode device key
-  int base64_decoded_device_key_length = base64_decode_chars(device_key, strlen(device_key), base64_decoded_device_key);
+  uint32_t expiration = getSecondsSinceEpoch() + SAS_TOKEN_DURATION_SECS;
 
-  if (base64_decoded_device_key_length == 0)
+  // Get signature
+  if (az_result_failed(az_iot_hub_client_sas_get_signature(
+          &client, expiration, signature_span, &out_signature_span)))
   {
-    Serial.println("Failed base64 decoding device key");
+    LOG_ERROR("Failed getting SAS signature");
     return 1;
   }
 
   // SHA-256 encrypt
-  br_hmac_key_context kc;
-  br_hmac_key_init(
-      &kc, &br_sha256_vtable, base64_decoded_device_key, base64_decoded_device_key_length);
-
   br_hmac_context hmac_ctx;
-  br_hmac_init(&hmac_ctx, &kc, 32);
+  br_hmac_init(&hmac_ctx, &device_key_context, 32);
   br_hmac_update(&hmac_ctx, az_span_ptr(out_signature_span), az_span_size(out_signature_span));
   br_hmac_out(&hmac_ctx, encrypted_signature);
 
-  // Base64 encode encrypted signature
-  String b64enc_hmacsha256_signature = base64::encode(encrypted_signature, br_hmac_size(&hmac_ctx));
+  // Base64 encode encrypted signature into a static buffer, no String involved
+  int b64enc_length = base64_encode_chars(
+      (const char *)encrypted_signature, br_hmac_size(&hmac_ctx), b64enc_hmacsha256_signature);
+  while (b64enc_length > 0 && b64enc_hmacsha256_signature[b64enc_length - 1] == '\n')
+  {
+    b64enc_length--;
+  }
 
-  az_span b64enc_hmacsha256_signature_span = az_span_create(
-      (uint8_t *)b64enc_hmacsha256_signature.c_str(), b64enc_hmacsha256_signature.length());
+  az_span b64enc_hmacsha256_signature_span
+      = az_span_create((uint8_t *)b64enc_hmacsha256_signature, b64enc_length);
 
   // URl-encode base64 encoded encrypted signature
   if (az_result_failed(az_iot_hub_client_sas_get_password(
@@ -240,13 +597,19 @@ static int generateSasToken(char *sas_token, size_t size)
           sas_token,
           size,
           NULL))) {
-    Serial.println("Failed getting SAS token");
+    LOG_ERROR("Failed getting SAS token");
     return 1;
   }
 
+  // Renew ahead of expiry, at a random point within the jitter window so a
+  // fleet that booted together does not reconnect together.
+  sas_token_renew_at = expiration - SAS_TOKEN_RENEWAL_MARGIN_SECS - (uint32_t)random(SAS_TOKEN_RENEWAL_JITTER_SECS + 1);
+  sas_token_valid = true;
   return 0;
 }
 
+static bool isSasTokenFresh() { return sas_token_valid && getSecondsSinceEpoch() < sas_token_renew_at; }
+
 static int connectToAzureIoTHub()
 {
   size_t client_id_length;
@@ -254,7 +617,7 @@ static int connectToAzureIoTHub()
   if (az_result_failed(az_iot_hub_client_get_client_id(
           &client, mqtt_client_id, sizeof(mqtt_client_id) - 1, &client_id_length)))
   {
-    Serial.println("Failed getting client id");
+    LOG_ERROR("Failed getting client id");
     return 1;
   }
 
@@ -265,234 +628,760 @@ static int connectToAzureIoTHub()
   if (az_result_failed(az_iot_hub_client_get_user_name(
           &client, mqtt_username, sizeofarray(mqtt_username), NULL)))
   {
-    printf("Failed to get MQTT clientId, return code\n");
+    LOG_ERROR("Failed to get MQTT user name");
     return 1;
   }
 
-  Serial.print("Client ID: ");
-  Serial.println(mqtt_client_id);
-
-  Serial.print("Username: ");
-  Serial.println(mqtt_username);
+  LOG_DEBUG("Client ID: %s", mqtt_client_id);
+  LOG_DEBUG("Username: %s", mqtt_username);
 
   mqtt_client.setBufferSize(MQTT_PACKET_SIZE);
 
-  while (!mqtt_client.connected())
+  // Single attempt; retries are paced by the connection state machine.
+  LOG_INFO("MQTT connecting");
+  if (!mqtt_client.connect(mqtt_client_id, mqtt_username, sas_token))
   {
-    time_t now = time(NULL);
-
-    Serial.print("MQTT connecting ... ");
-
-    if (mqtt_client.connect(mqtt_client_id, mqtt_username, sas_token))
-    {
-      Serial.println("connected.");
-    }
-    else
-    {
-      Serial.print("failed, status code =");
-      Serial.print(mqtt_client.state());
-      Serial.println(". Trying again in 5 seconds.");
-      // Wait 5 seconds before retrying
-      delay(5000);
-    }
+    LOG_WARN("MQTT connect failed, status code %d", mqtt_client.state());
+    return 1;
   }
+  LOG_INFO("MQTT connected");
 
   mqtt_client.subscribe(AZ_IOT_HUB_CLIENT_C2D_SUBSCRIBE_TOPIC);
+  mqtt_client.subscribe(AZ_IOT_HUB_CLIENT_TWIN_RESPONSE_SUBSCRIBE_TOPIC);
+  mqtt_client.subscribe(AZ_IOT_HUB_CLIENT_TWIN_PATCH_SUBSCRIBE_TOPIC);
 
   return 0;
 }
 
-static void establishConnection()
+static void enterBackoff(connection_state retry_state)
 {
-  connectToWiFi();
-  initializeTime();
-  printCurrentTime();
-  initializeClients();
+  // Exponential backoff with "equal jitter": wait between half and all of
+  // the current backoff, so a fleet that lost the same AP does not retry in
+  // lockstep.
+  uint32_t wait_ms = conn_backoff_ms / 2 + (uint32_t)random(conn_backoff_ms / 2 + 1);
 
-  // The SAS token is valid for 1 hour by default in this sample.
-  // After one hour the sample must be restarted, or the client won't be able
-  // to connect/stay connected to the Azure IoT Hub.
-  if (generateSasToken(sas_token, sizeofarray(sas_token)) != 0)
+  LOG_WARN("Connection attempt failed, retrying in %lu ms", (unsigned long)wait_ms);
+
+  conn_retry_state = retry_state;
+  conn_state_deadline_ms = millis() + wait_ms;
+  conn_state = CONNECTION_BACKOFF;
+
+  conn_backoff_ms = conn_backoff_ms * 2;
+  if (conn_backoff_ms > CONNECTION_BACKOFF_MAX_MS)
   {
-    Serial.println("Failed generating MQTT password");
+    conn_backoff_ms = CONNECTION_BACKOFF_MAX_MS;
   }
-  else
+}
+
+/*
+ * @brief Advances the WiFi -> time -> SAS -> MQTT connection by at most one step.
+ *        Never waits; WiFi association and SNTP progress in the background.
+ */
+static void serviceConnection()
+{
+  uint32_t now = millis();
+
+  switch (conn_state)
   {
-    connectToAzureIoTHub();
+    case CONNECTION_WIFI_START:
+      if (WiFi.status() == WL_CONNECTED)
+      {
+        conn_state = CONNECTION_TIME_WAIT;
+        break;
+      }
+      conn_state_deadline_ms = now + startWiFi();
+      conn_state = CONNECTION_WIFI_WAIT;
+      break;
+
+    case CONNECTION_WIFI_WAIT:
+    {
+      wl_status_t status = WiFi.status();
+      if (status == WL_CONNECTED)
+      {
+        IPAddress ip = WiFi.localIP();
+        LOG_INFO("WiFi connected, IP address: %u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+        health_count(HEALTH_EVENT_WIFI_CONNECT);
+        if (!wifi_cached_attempt)
+        {
+          cacheWiFiLease();
+        }
+        conn_state = CONNECTION_TIME_WAIT;
+      }
+      else if (wifi_cached_attempt
+               && (status == WL_NO_SSID_AVAIL || status == WL_CONNECT_FAILED
+                   || (int32_t)(now - conn_state_deadline_ms) >= 0))
+      {
+        // The access point moved or went away: scan right away instead of backing off
+        LOG_WARN("Cached association failed, scanning");
+        wifi_cache_clear();
+        conn_state = CONNECTION_WIFI_START;
+      }
+      else if ((int32_t)(now - conn_state_deadline_ms) >= 0)
+      {
+        enterBackoff(CONNECTION_WIFI_START);
+      }
+      break;
+    }
+
+    case CONNECTION_TIME_WAIT:
+      // SNTP only needs to run when the clock is not valid yet; once set it
+      // keeps running across MQTT reconnects.
+      if (WiFi.status() != WL_CONNECTED)
+      {
+        // No point waiting for SNTP without a link; the sync timeout starts
+        // over once WiFi is back
+        LOG_WARN("WiFi lost while waiting for the clock");
+        sntp_started = false;
+        conn_state = CONNECTION_WIFI_START;
+      }
+      else if (isTimeValid())
+      {
+        // A clock restored after deep sleep is an estimate; SNTP still
+        // corrects it in the background.
+        if (!sntp_started)
+        {
+          startTimeSync();
+        }
+        printCurrentTime();
+        conn_state = CONNECTION_MQTT_CONNECT;
+      }
+      else if (!sntp_started)
+      {
+        startTimeSync();
+        conn_state_deadline_ms = now + SNTP_SYNC_TIMEOUT_MS;
+      }
+      else if ((int32_t)(now - conn_state_deadline_ms) >= 0)
+      {
+        sntp_started = false;
+        enterBackoff(CONNECTION_WIFI_START);
+      }
+      break;
+
+    case CONNECTION_MQTT_CONNECT:
+      if (WiFi.status() != WL_CONNECTED)
+      {
+        conn_state = CONNECTION_WIFI_START;
+        break;
+      }
+      if (!clients_initialized)
+      {
+        clients_initialized = initializeClients();
+        if (!clients_initialized)
+        {
+          enterBackoff(CONNECTION_MQTT_CONNECT);
+          break;
+        }
+      }
+      probeTlsFragmentLength();
+
+      // The cached SAS token is reused across reconnects until it is due for
+      // renewal; see sasRenewalTask().
+      if (!isSasTokenFresh() && generateSasToken(sas_token, sizeofarray(sas_token)) != 0)
+      {
+        LOG_ERROR("Failed generating MQTT password");
+        enterBackoff(CONNECTION_TIME_WAIT);
+      }
+      else if (connectToAzureIoTHub() != 0)
+      {
+        enterBackoff(CONNECTION_MQTT_CONNECT);
+      }
+      else
+      {
+        conn_backoff_ms = CONNECTION_BACKOFF_MIN_MS;
+        conn_state = CONNECTION_CONNECTED;
+        health_count(HEALTH_EVENT_MQTT_CONNECT);
+        // Start every MQTT session with a keyframe
+        telemetry_delta_reset(&delta_state);
+        // Desired properties may have changed while we were away, and a
+        // report in flight on the old session will never be answered
+        twin_get_pending = true;
+        twin_get_in_flight = false;
+        twin_view_known = false;
+        twin_get_due_ms = millis();
+        twin_report_in_flight = false;
+        device_config_report_done(false);
+        writeLed(LOW);
+      }
+      break;
+
+    case CONNECTION_CONNECTED:
+      if (!mqtt_client.connected())
+      {
+        // Only redo the steps that were actually lost
+        LOG_WARN("MQTT connection lost");
+        health_count(HEALTH_EVENT_MQTT_DISCONNECT);
+        conn_state = (WiFi.status() == WL_CONNECTED) ? CONNECTION_MQTT_CONNECT : CONNECTION_WIFI_START;
+      }
+      break;
+
+    case CONNECTION_BACKOFF:
+      if ((int32_t)(now - conn_state_deadline_ms) >= 0)
+      {
+        conn_state = conn_retry_state;
+      }
+      break;
   }
+}
 
-  digitalWrite(LED_PIN, LOW);
+static bool mqttWriteChunk(const uint8_t *data, size_t length)
+{
+  return mqtt_client.write(data, length) == length;
+}
+
+/*
+ * @brief                      Completes a packet started with beginPublish(). Payloads are
+ *                             streamed straight into the connection, so a short write leaves
+ *                             the MQTT stream out of sync and the connection is dropped.
+ * @param[in] payload_written  true if exactly the announced length was written.
+ * @return bool                true if the whole packet went out.
+ */
+static bool endStreamedPublish(bool payload_written)
+{
+  if (!payload_written)
+  {
+    mqtt_client.disconnect();
+    return false;
+  }
+  return mqtt_client.endPublish() == 1;
 }
 
-az_iot_message_properties add_properties()
+/*
+ * @brief                   Serializes the oldest samples of source, see publishSamples().
+ * @param[in] packed        true for the delta+varint encoding, false for JSON.
+ * @param[in] source        Where the samples come from, oldest first.
+ * @param[in] max_samples   Most samples to put into the message.
+ * @param[in] sink          Receives the message, NULL to only measure it.
+ * @param[out] length       Bytes of the message.
+ * @return size_t           Number of samples serialized, 0 on failure.
+ */
+static size_t streamSamples(bool packed, telemetry_sample_source source, size_t max_samples,
+                            telemetry_chunk_sink sink, size_t *length)
 {
-  // Allocate a span to put the properties
-  uint8_t property_buffer[128]; // Increased buffer size to accommodate additional properties
-  az_span property_span = az_span_create(property_buffer, sizeof(property_buffer));
+  if (packed)
+  {
+    return telemetry_stream_packed(source, max_samples, telemetry_send_count, sink, length);
+  }
+  pending_delta_state = delta_state;
+  return telemetry_stream_batch(source, max_samples, telemetry_send_count, &pending_delta_state, sink, length);
+}
 
-  // Initialize the property struct with the span
-  az_iot_message_properties props;
-  az_iot_message_properties_init(&props, property_span, 0);
+/*
+ * @brief                   Publishes the oldest samples of source as one message.
+ * @param[in] source        Where the samples come from, oldest first.
+ * @param[in] batch_size    Samples to put into the message, no more than source holds.
+ *                          One is sent as a JSON object, more as a batch in the
+ *                          configured encoding.
+ * @return size_t           Number of samples published, 0 if nothing went out.
+ */
+static size_t publishSamples(telemetry_sample_source source, size_t batch_size)
+{
+  if (!publish_topics_ready)
+  {
+    return 0;
+  }
+  bool batch = batch_size > 1;
+  bool packed = batch && device_config_get()->batch_encoding == TELEMETRY_ENCODING_DELTA_VARINT;
+  const char *topic = publish_topics[packed ? MESSAGE_TYPE_BATCH_PACKED
+                                            : batch ? MESSAGE_TYPE_BATCH : MESSAGE_TYPE_TELEMETRY];
+
+  writeLed(HIGH);
+
+  // Deltas are taken against what the hub has actually received. The
+  // first pass only measures the message, the second one sends it; both
+  // start from the same delta state and so produce the same bytes.
+  size_t length;
+  uint32_t start = profiler_begin();
+  size_t count = streamSamples(packed, source, batch_size, NULL, &length);
+  profiler_end(PROFILE_TELEMETRY_PAYLOAD, start);
+  if (count == 0)
+  {
+    LOG_DEBUG("Telemetry: nothing queued");
+    writeLed(LOW);
+    return 0;
+  }
+  if (count < batch_size)
+  {
+    // The source lost samples it held, e.g. an unreadable spill log, and the
+    // rest moved up; the caller starts over from what is left
+    LOG_WARN("Telemetry: %u of %u samples readable, retrying", (unsigned)count, (unsigned)batch_size);
+    writeLed(LOW);
+    return 0;
+  }
 
+  start = profiler_begin();
+  uint32_t publish_started_us = micros();
+  bool published = mqtt_client.beginPublish(topic, length, false);
+  if (published)
+  {
+    size_t written;
+    size_t sent = streamSamples(packed, source, batch_size, mqttWriteChunk, &written);
+    published = endStreamedPublish(sent == count && written == length);
+  }
+  profiler_end(PROFILE_MQTT_PUBLISH, start);
+  if (BENCH_ENABLED)
+  {
+    soak_bench_publish(micros() - publish_started_us, published);
+  }
+  adaptive_rate_publish_result(published);
+  if (!published)
+  {
+    LOG_WARN("Telemetry publish failed");
+    health_count(HEALTH_EVENT_PUBLISH_FAILED);
+    writeLed(LOW);
+    return 0;
+  }
 
-  // Append UTF-8 property
-  az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR("content-encoding"), AZ_SPAN_FROM_STR("utf-8"));
+  telemetry_send_count += count;
+  if (packed)
+  {
+    // Packed messages carry every field; the next JSON message must not be
+    // a delta against a reference older than them
+    telemetry_delta_reset(&delta_state);
+  }
+  else
+  {
+    delta_state = pending_delta_state;
+  }
 
-  // Append content/json property
-  az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR("content-type"), AZ_SPAN_FROM_STR("application/json"));
-  
-  // Return the properties struct
-  return properties;
+  LOG_DEBUG("Telemetry sent, samples: %u", (unsigned)count);
+  // The LED task switches the LED off again once LED_ON_TIME_MS has passed
+  led_on = true;
+  led_off_time_ms = millis() + LED_ON_TIME_MS;
+  return count;
 }
 
+/*
+ * @brief         Publishes the oldest queued samples and removes them from the queue
+ *                once the hub accepted the message. A backlog of more samples than
+ *                a live batch holds goes out TELEMETRY_DRAIN_BATCH_MAX_SAMPLES at a time.
+ * @return bool   true if a message was published.
+ */
+static bool sendTelemetry()
+{
+  size_t pending = sample_queue_count();
+  size_t limit = device_config_get()->batch_max_samples;
+  if (pending > limit && limit < TELEMETRY_DRAIN_BATCH_MAX_SAMPLES)
+  {
+    limit = TELEMETRY_DRAIN_BATCH_MAX_SAMPLES;
+  }
+  size_t count = publishSamples(sample_queue_peek, pending < limit ? pending : limit);
+  if (count == 0)
+  {
+    return false;
+  }
+  sample_queue_pop(count);
+  // What is left starts the next batch, so its age counts from now
+  if (sample_queue_count() > 0)
+  {
+    batch_started_ms = millis();
+  }
+  return true;
+}
 
-
-static char *getTelemetryPayload(payload_structure *payload_data)
+/*
+ * @brief         Publishes the health report as its own message, tagged with a
+ *                "msgType" application property so it can be routed separately.
+ * @return bool   true if the hub accepted the message.
+ */
+static bool sendHealth()
 {
-az_span temp_span = az_span_create(telemetry_payload, sizeof(telemetry_payload));
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR("{ \"msgCount\": "));
-(void)az_span_u32toa(temp_span, telemetry_send_count++, &temp_span);
+  if (!publish_topics_ready)
+  {
+    return false;
+  }
 
+  az_span remainder = health_write_payload(AZ_SPAN_FROM_BUFFER(health_payload));
+  size_t length = sizeof(health_payload) - az_span_size(remainder);
 
+  if (!mqtt_client.beginPublish(publish_topics[MESSAGE_TYPE_HEALTH], length, false)
+      || !endStreamedPublish(mqttWriteChunk(health_payload, length)))
+  {
+    health_count(HEALTH_EVENT_PUBLISH_FAILED);
+    return false;
+  }
+  health_window_reset();
+  return true;
+}
 
-// ------------------- Sensor - 1 ---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensor_1_type\": \""));
-(void)az_span_i32toa(temp_span, payload_data->sensor_1_type, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR("\", \"sensor_1_temperature\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensor_1_temperature, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensors_1_humidity\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensors_1_humidity, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensor_1_light\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensor_1_light, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensor_1_CO2\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensor_1_CO2, &temp_span);
+// Scheduler tasks
 
-// ------------------- Sensor - 2 ---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensor_2_type\": \""));
-(void)az_span_i32toa(temp_span, payload_data->sensor_2_type, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR("\", \"sensor_2_temperature\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensor_2_temperature, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensors_2_humidity\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensors_2_humidity, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensor_2_light\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensor_2_light, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"sensor_2_CO2\": "));
-(void)az_span_i32toa(temp_span, payload_data->sensor_2_CO2, &temp_span);
+static void serialRxTask()
+{
+  uint32_t start = profiler_begin();
+  read_serial_port(&latest_payload);
+  if (BENCH_ENABLED)
+  {
+    // UART0 is looped back: set commands would come back in as broken frames
+    serial_discard_commands();
+  }
+  else
+  {
+    serial_flush_commands();
+  }
+  profiler_end(PROFILE_SERIAL_READ, start);
+}
 
-// ------------------- Fan - 1 ---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"fan_1_type\": \""));
-(void)az_span_i32toa(temp_span, payload_data->fan_1_type, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR("\", \"fan_1_set_percent\": "));
-(void)az_span_i32toa(temp_span, payload_data->fan_1_set_percent, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"fan_1_speed\": "));
-(void)az_span_i32toa(temp_span, payload_data->fan_1_speed, &temp_span);
+// MQTT loop must be called to process Device-to-Cloud and Cloud-to-Device.
+static void mqttLoopTask()
+{
+  uint32_t start = profiler_begin();
+  mqtt_client.loop();
+  profiler_end(PROFILE_MQTT_LOOP, start);
+}
 
+// Console commands arrive on the sensor link as lines starting with '!'
+static void serialCommand(const char *command, size_t length)
+{
+  az_span command_span = az_span_create((uint8_t *)command, length);
 
-// ------------------- Fan - 2 ---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"fan_2_type\": \""));
-(void)az_span_i32toa(temp_span, payload_data->fan_2_type, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR("\", \"fan_2_set_percent\": "));
-(void)az_span_i32toa(temp_span, payload_data->fan_2_set_percent, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"fan_2_speed\": "));
-(void)az_span_i32toa(temp_span, payload_data->fan_2_speed, &temp_span);
+  if (az_span_is_content_equal(command_span, AZ_SPAN_FROM_STR("profile")))
+  {
+    profiler_dump(Serial);
+  }
+  else if (az_span_is_content_equal(command_span, AZ_SPAN_FROM_STR("profile reset")))
+  {
+    profiler_reset();
+  }
+  else if (az_span_is_content_equal(command_span, AZ_SPAN_FROM_STR("log")))
+  {
+    logger_dump(Serial);
+  }
+}
 
+// C2D override of the telemetry interval; it is reported like a twin change
+static void setTelemetryInterval(uint32_t period_ms)
+{
+  if (device_config_set(CONFIG_TELEMETRY_INTERVAL, (int32_t)period_ms))
+  {
+    applyDeviceConfig();
+  }
+}
 
+// Every telemetry tick captures a sample into the queue, connected or not;
+// the drain task publishes from the queue while the hub is reachable.
+static void telemetryTask()
+{
+  telemetry_sample sample;
+  sample.timestamp = isTimeValid() ? getSecondsSinceEpoch() : 0;
+  payload_buffer_read(&latest_payload, &sample.payload);
+  aggregator_take(&sample);
+  if (sample_queue_count() == 0)
+  {
+    batch_started_ms = millis();
+  }
+  sample_queue_push(&sample);
 
-// ------------------- Relay - CO2 ---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"relay_CO2\": "));
-(void)az_span_i32toa(temp_span, payload_data->relay_CO2, &temp_span);
+  // Sample faster while readings move, slower while they are stable or the link struggles
+  int32_t rssi_dbm = (WiFi.status() == WL_CONNECTED) ? WiFi.RSSI() : 0;
+  scheduler_task *task = scheduler_find("telemetry");
+  if (task != NULL)
+  {
+    scheduler_set_period(task, adaptive_rate_next_interval(&sample.payload, millis(), rssi_dbm));
+  }
+}
 
-// ------------------- Relay - Programmable 1 ---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"relay_programmable_1\": \""));
-(void)az_span_i32toa(temp_span, payload_data->relay_programmable_1, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR("\""));
+static void drainTask()
+{
+  size_t pending = sample_queue_count();
 
-// ------------------- Relay - Programmable 2 ---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"relay_programmable_2\": \""));
-(void)az_span_i32toa(temp_span, payload_data->relay_programmable_2, &temp_span);
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR("\""));
+  if (pending == 0 || conn_state != CONNECTION_CONNECTED || !mqtt_client.connected())
+  {
+    return;
+  }
 
-// ------------------- PWM - Light---------------------//
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(", \"pwm_light\": "));
-(void)az_span_i32toa(temp_span, payload_data->pwm_light, &temp_span);
+  // Hold a partial batch back until it reaches its maximum age, counted from
+  // its first sample or from the publish that left it behind. Full batches
+  // of an offline backlog go out straight away.
+  const device_config *config = device_config_get();
+  if (pending < (size_t)config->batch_max_samples
+      && (uint32_t)(millis() - batch_started_ms) < (uint32_t)config->batch_max_age_ms)
+  {
+    return;
+  }
 
-temp_span = az_span_copy(temp_span, AZ_SPAN_FROM_STR(" }"));
-temp_span = az_span_copy_u8(temp_span, '\0');
+  sendTelemetry();
+}
 
+static void ledTask()
+{
+  if (led_on && (int32_t)(millis() - led_off_time_ms) >= 0)
+  {
+    writeLed(LOW);
+    led_on = false;
+  }
+}
 
+static void reconnectTask() { serviceConnection(); }
 
-  return (char *)telemetry_payload;
-}
+// IoT Hub only accepts a new SAS token on CONNECT. Renew the token before it
+// expires, close the session cleanly and let the state machine reconnect
+// straight away, instead of being dropped by the hub at expiry.
+static void sasRenewalTask()
+{
+  if (conn_state != CONNECTION_CONNECTED || isSasTokenFresh())
+  {
+    return;
+  }
 
+  LOG_INFO("Renewing SAS token");
+  if (generateSasToken(sas_token, sizeofarray(sas_token)) != 0)
+  {
+    // Keep the current session; the token is still valid for a while
+    return;
+  }
+
+  mqtt_client.disconnect();
+  conn_state = CONNECTION_MQTT_CONNECT;
+}
 
-static void sendTelemetry()
+/*
+ * @brief   Requests the full twin after every (re)connect and reports configuration
+ *          changes, one patch in flight at a time.
+ */
+static void twinTask()
 {
+  char topic[TWIN_TOPIC_SIZE];
 
-///
+  if (conn_state != CONNECTION_CONNECTED || !mqtt_client.connected())
+  {
+    return;
+  }
 
-uint8_t property_buffer[64];  // Increased buffer size to accommodate additional properties
-az_span property_span = az_span_create(property_buffer, sizeof(property_buffer));
-// Initialize the property struct with the span
-az_iot_message_properties props;
-az_iot_message_properties_init(&props, property_span, 0);
-// Append UTF-8 property
-az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_TYPE), AZ_SPAN_LITERAL_FROM_STR("application%2Fjson"));
-// Append content/json property
-az_iot_message_properties_append(&props, AZ_SPAN_FROM_STR(AZ_IOT_MESSAGE_PROPERTIES_CONTENT_ENCODING), AZ_SPAN_LITERAL_FROM_STR("UTF-8"));
+  uint32_t now = millis();
+  if (twin_get_in_flight && (uint32_t)(now - twin_get_sent_ms) >= TWIN_RESPONSE_TIMEOUT_MS)
+  {
+    // PubSubClient drops packets larger than its buffer without a trace, a
+    // twin document that outgrew MQTT_PACKET_SIZE included. Reports go ahead
+    // with the local settings meanwhile.
+    LOG_WARN("No twin document within %lu ms, over %u bytes? Retrying", (unsigned long)TWIN_RESPONSE_TIMEOUT_MS,
+             (unsigned)MQTT_PACKET_SIZE);
+    health_count(HEALTH_EVENT_TWIN_GET_TIMEOUT);
+    twin_get_in_flight = false;
+    twin_view_known = true;
+    twin_get_pending = true;
+    twin_get_due_ms = now + TWIN_GET_RETRY_MS;
+  }
+  if (twin_get_pending && (int32_t)(now - twin_get_due_ms) >= 0
+      && az_result_succeeded(az_iot_hub_client_twin_document_get_publish_topic(
+          &client, AZ_SPAN_FROM_STR(TWIN_GET_REQUEST_ID), topic, sizeof(topic), NULL))
+      && mqtt_client.publish(topic, NULL, 0, false))
+  {
+    twin_get_pending = false;
+    twin_get_in_flight = true;
+    twin_get_sent_ms = now;
+  }
+  // Report once the hub's view of the twin is known, so reported values
+  // cannot race desired ones still on their way
+  if (!twin_view_known)
+  {
+    return;
+  }
 
-az_iot_message_properties *ptr_props;
-ptr_props = &props;
+  if (twin_report_in_flight && (uint32_t)(now - twin_report_sent_ms) >= TWIN_RESPONSE_TIMEOUT_MS)
+  {
+    device_config_report_done(false);
+    twin_report_in_flight = false;
+  }
+  if (twin_report_in_flight || !device_config_report_pending())
+  {
+    return;
+  }
 
-///
-// az_iot_message_properties temp_properties = add_properties();
-// const az_iot_message_properties* properties = &temp_properties;
-  digitalWrite(LED_PIN, HIGH);
-  Serial.print(millis());
-  Serial.print(" ESP8266 Sending telemetry . . . ");
-  if (az_result_failed(az_iot_hub_client_telemetry_get_publish_topic(
-          &client, ptr_props, telemetry_topic, sizeof(telemetry_topic), NULL)))
+  if (az_result_failed(az_iot_hub_client_twin_patch_get_publish_topic(
+          &client, AZ_SPAN_FROM_STR(TWIN_REPORT_REQUEST_ID), topic, sizeof(topic), NULL)))
   {
-    Serial.println("Failed az_iot_hub_client_telemetry_get_publish_topic");
     return;
   }
+  az_span remainder = device_config_write_reported(AZ_SPAN_FROM_BUFFER(twin_reported_payload));
+  size_t length = sizeof(twin_reported_payload) - az_span_size(remainder);
 
-  mqtt_client.publish(telemetry_topic, getTelemetryPayload(&payload_data), false);
+  if (mqtt_client.publish(topic, twin_reported_payload, length, false))
+  {
+    twin_report_in_flight = true;
+    twin_report_sent_ms = millis();
+  }
+  else
+  {
+    device_config_report_done(false);
+  }
+}
 
-  Serial.println("OK");
-  delay(100);
-  digitalWrite(LED_PIN, LOW);
+static void healthSampleTask()
+{
+  health_sample();
+  if (BENCH_ENABLED)
+  {
+    soak_bench_sample();
+  }
 }
 
-// Arduino setup and loop main functions.
+static void healthReportTask()
+{
+  if (conn_state == CONNECTION_CONNECTED && mqtt_client.connected())
+  {
+    sendHealth();
+  }
+}
 
-void setup()
+/*
+ * @brief   Ends a deep-sleep wake. The sleep is shortened by the time spent
+ *          awake, so wakes stay DEEP_SLEEP_INTERVAL_MILLISECS apart.
+ */
+static void sleepUntilNextWake()
 {
-  pinMode(LED_PIN, OUTPUT);
-  digitalWrite(LED_PIN, HIGH);
-  establishConnection();
+  uint32_t awake_ms = millis();
+  uint32_t sleep_ms = DEEP_SLEEP_INTERVAL_MILLISECS;
+
+  sleep_ms = awake_ms + WAKE_MIN_SLEEP_MS < sleep_ms ? sleep_ms - awake_ms : WAKE_MIN_SLEEP_MS;
+  if (mqtt_client.connected())
+  {
+    // Sends DISCONNECT and flushes the socket before the radio goes down
+    mqtt_client.disconnect();
+  }
+  LOG_INFO("Sleeping for %lu ms", (unsigned long)sleep_ms);
+  logger_flush();
+  deep_sleep_enter(sleep_ms);
 }
 
-void loop()
+/*
+ * @brief   Restores what was kept in RTC memory across the sleep; the clock is
+ *          set again so samples are stamped and SAS tokens signed without SNTP.
+ */
+static void restoreWake()
 {
-  read_serial_port(&payload_data); //read data from serial -> processing_functions
-  if (millis() > next_telemetry_send_time_ms)
+  if (!deep_sleep_restore())
+  {
+    LOG_INFO("No samples kept in RTC memory");
+  }
+  telemetry_send_count = deep_sleep_sequence();
+  wake_connects = deep_sleep_connect_due();
+  if (time_base_estimated())
+  {
+    LOG_INFO("Clock restored, sleep timer correction %ld ppm", (long)time_base_sleep_ppm());
+  }
+}
+
+// One sample per wake: once a frame arrived, or the MCU stayed silent for
+// too long. Connect wakes then publish everything kept in RTC memory as one
+// batch, the others go straight back to sleep.
+static void wakeTask()
+{
+  uint32_t awake_ms = millis();
+
+  if (!wake_sampled)
   {
-    // Check if connected, reconnect if needed.
-    if (!mqtt_client.connected())
+    if (aggregator_frame_count() == 0 && awake_ms < DEEP_SLEEP_COLLECT_TIMEOUT_MILLISECS)
     {
+      return;
+    }
+    telemetry_sample sample;
+    sample.timestamp = isTimeValid() ? getSecondsSinceEpoch() : 0;
+    payload_buffer_read(&latest_payload, &sample.payload);
+    aggregator_take(&sample);
+    // Without a frame the payload holds nothing measured since the wake
+    if (sample.frame_count > 0)
+    {
+      deep_sleep_store(&sample);
+    }
+    wake_sampled = true;
+  }
 
-      establishConnection();
+  if (!wake_connects)
+  {
+    sleepUntilNextWake();
+  }
+  else if (conn_state == CONNECTION_CONNECTED && mqtt_client.connected())
+  {
+    size_t pending = deep_sleep_sample_count();
+    if (pending == 0 || publishSamples(deep_sleep_peek, pending) > 0)
+    {
+      deep_sleep_published(telemetry_send_count);
     }
-sendTelemetry();
-Serial.println("we got here");
-    next_telemetry_send_time_ms = millis() + TELEMETRY_FREQUENCY_MILLISECS;
+    sleepUntilNextWake();
+  }
+  else if (awake_ms >= DEEP_SLEEP_CONNECT_TIMEOUT_MILLISECS)
+  {
+    // The samples stay in RTC memory for the next connect wake
+    sleepUntilNextWake();
   }
+}
 
-  // MQTT loop must be called to process Device-to-Cloud and Cloud-to-Device.
-  mqtt_client.loop();
-  Serial.println("did we loop ?");
-  delay(1000);
+// Synthetic sensor feed and soak report of the bench firmware
+static void benchFeedTask() { soak_bench_feed(); }
+
+static void benchReportTask() { soak_bench_report(); }
+
+// The radio is off on wakes that do not connect
+static void wakeReconnectTask()
+{
+  if (wake_connects)
+  {
+    serviceConnection();
+  }
 }
 
+static scheduler_task tasks[] = {
+  // name, callback, period_ms, deadline_ms
+  { "serial_rx", serialRxTask, SERIAL_RX_PERIOD_MS, SERIAL_RX_DEADLINE_MS },
+  { "mqtt_loop", mqttLoopTask, MQTT_LOOP_PERIOD_MS, MQTT_LOOP_DEADLINE_MS },
+  { "reconnect", reconnectTask, RECONNECT_PERIOD_MS, RECONNECT_DEADLINE_MS },
+  { "sas_renewal", sasRenewalTask, SAS_RENEWAL_PERIOD_MS, SAS_RENEWAL_DEADLINE_MS },
+  { "telemetry", telemetryTask, TELEMETRY_FREQUENCY_MILLISECS, TELEMETRY_DEADLINE_MS },
+  { "drain", drainTask, TELEMETRY_DRAIN_INTERVAL_MILLISECS, DRAIN_DEADLINE_MS },
+  { "led", ledTask, LED_PERIOD_MS, LED_DEADLINE_MS },
+  { "health_sample", healthSampleTask, HEALTH_SAMPLE_PERIOD_MS, HEALTH_SAMPLE_DEADLINE_MS },
+  { "health_report", healthReportTask, HEALTH_REPORT_INTERVAL_MILLISECS, HEALTH_REPORT_DEADLINE_MS },
+  { "twin", twinTask, TWIN_PERIOD_MS, TWIN_DEADLINE_MS },
+#if BENCH_ENABLED
+  { "bench_feed", benchFeedTask, BENCH_FEED_PERIOD_MS, BENCH_FEED_DEADLINE_MS },
+  { "bench_report", benchReportTask, BENCH_REPORT_INTERVAL_MILLISECS, BENCH_REPORT_DEADLINE_MS },
+#endif
+};
+
+// Tasks of a deep-sleep wake, see DEEP_SLEEP_ENABLED
+static scheduler_task wake_tasks[] = {
+  // name, callback, period_ms, deadline_ms
+  { "serial_rx", serialRxTask, SERIAL_RX_PERIOD_MS, SERIAL_RX_DEADLINE_MS },
+  { "mqtt_loop", mqttLoopTask, MQTT_LOOP_PERIOD_MS, MQTT_LOOP_DEADLINE_MS },
+  { "reconnect", wakeReconnectTask, RECONNECT_PERIOD_MS, RECONNECT_DEADLINE_MS },
+  { "wake", wakeTask, WAKE_TASK_PERIOD_MS, WAKE_TASK_DEADLINE_MS },
+};
+
+static scheduler_task *active_tasks = tasks;
+static size_t active_task_count = sizeofarray(tasks);
 
+// Arduino setup and loop main functions.
+
+void setup()
+{
+  if (LED_ENABLED)
+  {
+    pinMode(LED_PIN, OUTPUT);
+  }
+  writeLed(HIGH);
+  serial_begin();
+  logger_begin();
+  if (BENCH_ENABLED)
+  {
+    soak_bench_begin();
+  }
+  initializeTls();
+  time_base_begin();
+  serial_set_command_handler(serialCommand);
+  serial_set_frame_handler(aggregator_add);
+  cloud_commands_set_interval_handler(setTelemetryInterval);
+  if (DEEP_SLEEP_ENABLED)
+  {
+    restoreWake();
+    active_tasks = wake_tasks;
+    active_task_count = sizeofarray(wake_tasks);
+  }
+  else if (!sample_queue_init())
+  {
+    LOG_WARN("Failed mounting LittleFS, offline samples will stay in RAM only");
+  }
+  scheduler_init(active_tasks, active_task_count);
+  applyDeviceConfig();
+}
 
+void loop() { health_record_loop(scheduler_run(active_tasks, active_task_count)); }
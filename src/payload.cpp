@@ -0,0 +1,290 @@
+#include <payload.h>
+
+#include <limits>
+#include <string.h>
+
+#define FIELD_INFO(id, name, type, kind, quoted, scale)                                                   \
+  { #name, sizeof(#name) - 1, kind, quoted, scale, sizeof(type), std::numeric_limits<type>::min(), \
+    std::numeric_limits<type>::max() },
+
+static const payload_field_info sensor_fields[SENSOR_CHANNEL_FIELD_COUNT] = { SENSOR_CHANNEL_FIELDS(FIELD_INFO) };
+static const payload_field_info fan_fields[FAN_CHANNEL_FIELD_COUNT] = { FAN_CHANNEL_FIELDS(FIELD_INFO) };
+static const payload_field_info controller_fields[CONTROLLER_FIELD_COUNT] = { CONTROLLER_FIELDS(FIELD_INFO) };
+
+#undef FIELD_INFO
+
+typedef struct {
+  const payload_field_info *fields;
+  uint8_t field_count;
+  uint8_t capacity;        // channels the payload has room for
+  az_span key_prefix;      // followed by the 1 based channel number; empty for the controller
+  payload_slot first_slot;
+} group_info;
+
+static const group_info groups[] = {
+  { sensor_fields, SENSOR_CHANNEL_FIELD_COUNT, PAYLOAD_MAX_SENSORS, AZ_SPAN_LITERAL_FROM_STR(PAYLOAD_SENSOR_KEY_PREFIX),
+    PAYLOAD_SENSOR_SLOT(0, 0) },
+  { fan_fields, FAN_CHANNEL_FIELD_COUNT, PAYLOAD_MAX_FANS, AZ_SPAN_LITERAL_FROM_STR(PAYLOAD_FAN_KEY_PREFIX),
+    PAYLOAD_FAN_SLOT(0, 0) },
+  { controller_fields, CONTROLLER_FIELD_COUNT, 1, AZ_SPAN_LITERAL_FROM_STR(""), PAYLOAD_CONTROLLER_SLOT(0) },
+};
+
+#define GROUP_COUNT (sizeof(groups) / sizeof(groups[0]))
+
+static uint8_t channelsPresent(const payload_structure *payload, uint8_t group) {
+  switch (group) {
+    case PAYLOAD_GROUP_SENSOR: return payload->sensor_count;
+    case PAYLOAD_GROUP_FAN: return payload->fan_count;
+    default: return 1;
+  }
+}
+
+static void updateSlot(payload_cursor *cursor) {
+  const group_info *group = &groups[cursor->group];
+  cursor->slot = group->first_slot + cursor->channel * group->field_count + cursor->field;
+}
+
+// Moves past groups with no channel left; false at the end of the payload
+static bool settle(const payload_structure *payload, payload_cursor *cursor) {
+  while (cursor->group < GROUP_COUNT && cursor->channel >= channelsPresent(payload, cursor->group)) {
+    cursor->group++;
+    cursor->channel = 0;
+    cursor->field = 0;
+  }
+  if (cursor->group == GROUP_COUNT) {
+    cursor->slot = PAYLOAD_SLOT_COUNT;
+    return false;
+  }
+  updateSlot(cursor);
+  return true;
+}
+
+// Sets the channel counts; false, leaving the payload untouched, if either
+// is out of range. Channels beyond the new counts keep their old values
+// but are no longer part of the payload.
+bool payload_set_channels(payload_structure *payload, int32_t sensor_count, int32_t fan_count) {
+  if (sensor_count < 0 || sensor_count > PAYLOAD_MAX_SENSORS || fan_count < 0 || fan_count > PAYLOAD_MAX_FANS) {
+    return false;
+  }
+  payload->sensor_count = (uint8_t)sensor_count;
+  payload->fan_count = (uint8_t)fan_count;
+  return true;
+}
+
+bool payload_same_channels(const payload_structure *a, const payload_structure *b) {
+  return a->sensor_count == b->sensor_count && a->fan_count == b->fan_count;
+}
+
+// Walks the fields of the channels present, in serial frame order:
+//   for (bool more = payload_begin(p, &c); more; more = payload_next(p, &c))
+bool payload_begin(const payload_structure *payload, payload_cursor *cursor) {
+  cursor->group = PAYLOAD_GROUP_SENSOR;
+  cursor->channel = 0;
+  cursor->field = 0;
+  return settle(payload, cursor);
+}
+
+bool payload_next(const payload_structure *payload, payload_cursor *cursor) {
+  if (++cursor->field == groups[cursor->group].field_count) {
+    cursor->field = 0;
+    cursor->channel++;
+  }
+  return settle(payload, cursor);
+}
+
+// Points cursor at any slot, whether its channel is present or not
+bool payload_seek(payload_slot slot, payload_cursor *cursor) {
+  if (slot >= PAYLOAD_SLOT_COUNT) {
+    return false;
+  }
+
+  uint8_t group = GROUP_COUNT - 1;
+  while (slot < groups[group].first_slot) {
+    group--;
+  }
+  payload_slot offset = slot - groups[group].first_slot;
+  cursor->slot = slot;
+  cursor->group = group;
+  cursor->channel = (uint8_t)(offset / groups[group].field_count);
+  cursor->field = (uint8_t)(offset % groups[group].field_count);
+  return true;
+}
+
+// Resolves a telemetry key such as "sensor_3_CO2" or "relay_CO2"
+bool payload_find(az_span key, payload_cursor *cursor) {
+  for (uint8_t g = 0; g < GROUP_COUNT; g++) {
+    const group_info *group = &groups[g];
+    int32_t prefix_size = az_span_size(group->key_prefix);
+    az_span name = key;
+    uint8_t channel = 0;
+
+    if (prefix_size > 0) {
+      if (az_span_size(key) <= prefix_size
+          || !az_span_is_content_equal(az_span_slice(key, 0, prefix_size), group->key_prefix)) {
+        continue;
+      }
+      // One or two digits, no leading zero, then '_'
+      const uint8_t *digits = az_span_ptr(key) + prefix_size;
+      int32_t remaining = az_span_size(key) - prefix_size;
+      int32_t number = 0;
+      int32_t length = 0;
+      while (length < remaining && length < 2 && digits[length] >= '0' && digits[length] <= '9') {
+        number = number * 10 + (digits[length] - '0');
+        length++;
+      }
+      if (length == 0 || digits[0] == '0' || length >= remaining || digits[length] != '_' || number > group->capacity) {
+        continue;
+      }
+      channel = (uint8_t)(number - 1);
+      name = az_span_slice_to_end(key, prefix_size + length + 1);
+    }
+
+    for (uint8_t f = 0; f < group->field_count; f++) {
+      const payload_field_info *info = &group->fields[f];
+      if (az_span_is_content_equal(name, az_span_create((uint8_t *)info->name, info->name_length))) {
+        cursor->group = g;
+        cursor->channel = channel;
+        cursor->field = f;
+        updateSlot(cursor);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+const payload_field_info *payload_field(const payload_cursor *cursor) {
+  return &groups[cursor->group].fields[cursor->field];
+}
+
+int32_t payload_get(const payload_structure *payload, const payload_cursor *cursor) {
+#define GET_FIELD(id, name, type, kind, quoted, scale) \
+  case id: return source.name;
+
+  switch (cursor->group) {
+    case PAYLOAD_GROUP_SENSOR: {
+      const sensor_channel &source = payload->sensors[cursor->channel];
+      switch (cursor->field) {
+        SENSOR_CHANNEL_FIELDS(GET_FIELD)
+      }
+      break;
+    }
+    case PAYLOAD_GROUP_FAN: {
+      const fan_channel &source = payload->fans[cursor->channel];
+      switch (cursor->field) {
+        FAN_CHANNEL_FIELDS(GET_FIELD)
+      }
+      break;
+    }
+    case PAYLOAD_GROUP_CONTROLLER: {
+      const payload_structure &source = *payload;
+      switch (cursor->field) {
+        CONTROLLER_FIELDS(GET_FIELD)
+      }
+      break;
+    }
+  }
+  return 0;
+
+#undef GET_FIELD
+}
+
+// Stores value if it fits the field's type; false leaves the field as is.
+bool payload_set(payload_structure *payload, const payload_cursor *cursor, int32_t value) {
+  const payload_field_info *info = payload_field(cursor);
+  if (value < info->min || value > info->max) {
+    return false;
+  }
+
+#define SET_FIELD(id, name, type, kind, quoted, scale) \
+  case id: target.name = (type)value; return true;
+
+  switch (cursor->group) {
+    case PAYLOAD_GROUP_SENSOR: {
+      sensor_channel &target = payload->sensors[cursor->channel];
+      switch (cursor->field) {
+        SENSOR_CHANNEL_FIELDS(SET_FIELD)
+      }
+      break;
+    }
+    case PAYLOAD_GROUP_FAN: {
+      fan_channel &target = payload->fans[cursor->channel];
+      switch (cursor->field) {
+        FAN_CHANNEL_FIELDS(SET_FIELD)
+      }
+      break;
+    }
+    case PAYLOAD_GROUP_CONTROLLER: {
+      payload_structure &target = *payload;
+      switch (cursor->field) {
+        CONTROLLER_FIELDS(SET_FIELD)
+      }
+      break;
+    }
+  }
+  return false;
+
+#undef SET_FIELD
+}
+
+// Writes the telemetry key of the field, e.g. "sensor_3_CO2", and returns
+// the unused remainder of destination.
+az_span payload_write_key(az_span destination, const payload_cursor *cursor) {
+  const group_info *group = &groups[cursor->group];
+  const payload_field_info *info = &group->fields[cursor->field];
+
+  if (az_span_size(group->key_prefix) > 0) {
+    destination = az_span_copy(destination, group->key_prefix);
+    (void)az_span_u32toa(destination, cursor->channel + 1, &destination);
+    destination = az_span_copy_u8(destination, '_');
+  }
+  return az_span_copy(destination, az_span_create((uint8_t *)info->name, info->name_length));
+}
+
+size_t payload_packed_length(const payload_structure *payload) {
+  return PAYLOAD_PACKED_LENGTH(payload->sensor_count, payload->fan_count);
+}
+
+// Packs the channels present into payload_packed_length() bytes.
+size_t payload_pack(const payload_structure *payload, uint8_t *out) {
+  uint8_t *start = out;
+  payload_cursor cursor;
+
+  *out++ = payload->sensor_count;
+  *out++ = payload->fan_count;
+  for (bool more = payload_begin(payload, &cursor); more; more = payload_next(payload, &cursor)) {
+    uint32_t bits = (uint32_t)payload_get(payload, &cursor);
+    for (uint8_t i = 0; i < payload_field(&cursor)->size; i++) {
+      *out++ = (uint8_t)(bits >> (8 * i));
+    }
+  }
+  return out - start;
+}
+
+// Reads one packed payload from the first length bytes of in. Returns the
+// bytes it took, or 0, leaving payload untouched, if they do not hold one.
+size_t payload_unpack(const uint8_t *in, size_t length, payload_structure *payload) {
+  if (length < PAYLOAD_HEADER_LENGTH || in[0] > PAYLOAD_MAX_SENSORS || in[1] > PAYLOAD_MAX_FANS
+      || length < PAYLOAD_PACKED_LENGTH(in[0], in[1])) {
+    return 0;
+  }
+
+  payload_cursor cursor;
+  const uint8_t *start = in;
+
+  payload_set_channels(payload, in[0], in[1]);
+  in += PAYLOAD_HEADER_LENGTH;
+  for (bool more = payload_begin(payload, &cursor); more; more = payload_next(payload, &cursor)) {
+    const payload_field_info *info = payload_field(&cursor);
+    uint32_t bits = 0;
+    for (uint8_t i = 0; i < info->size; i++) {
+      bits |= (uint32_t)*in++ << (8 * i);
+    }
+    // Sign extend signed fields narrower than 32 bits
+    if (info->min < 0 && info->size < 4 && (bits >> (8 * info->size - 1)) & 1) {
+      bits |= ~(uint32_t)0 << (8 * info->size);
+    }
+    payload_set(payload, &cursor, (int32_t)bits);
+  }
+  return in - start;
+}
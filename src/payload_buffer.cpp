@@ -0,0 +1,45 @@
+#include <payload_buffer.h>
+
+// Keeps the compiler from moving slot accesses across the counter updates;
+// the ESP8266 is a single in-order core, so no hardware fence is needed.
+#define COMPILER_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+// Returns the slot to parse the next frame into. Readers keep using the
+// other one until payload_buffer_write_end() publishes this one.
+payload_structure *payload_buffer_write_begin(payload_buffer *buffer) {
+  uint32_t next = buffer->published + 1;
+  buffer->started = next;
+  COMPILER_BARRIER();
+  return &buffer->slots[next & 1];
+}
+
+// Publishes the slot, or gives it up if the frame did not parse.
+void payload_buffer_write_end(payload_buffer *buffer, bool publish) {
+  COMPILER_BARRIER();
+  if (publish) {
+    buffer->published = buffer->started;
+  } else {
+    buffer->started = buffer->published;
+  }
+}
+
+const payload_structure *payload_buffer_read_begin(const payload_buffer *buffer, uint32_t *sequence) {
+  *sequence = buffer->published;
+  COMPILER_BARRIER();
+  return &buffer->slots[*sequence & 1];
+}
+
+// true if the slot returned with sequence stayed untouched. The writer only
+// gets back to it after publishing the other slot and beginning the next.
+bool payload_buffer_read_end(const payload_buffer *buffer, uint32_t sequence) {
+  COMPILER_BARRIER();
+  return buffer->started - sequence <= 1;
+}
+
+// Copies a consistent snapshot of the latest frame into out.
+void payload_buffer_read(const payload_buffer *buffer, payload_structure *out) {
+  uint32_t sequence;
+  do {
+    *out = *payload_buffer_read_begin(buffer, &sequence);
+  } while (!payload_buffer_read_end(buffer, sequence));
+}
@@ -1,62 +1,439 @@
 #include <processing_functions.h>
+#include <profiler.h>
+#include <serial_protocol.h>
 
-#define MAX_TOTAL_LENGTH 20
-// |sensor_1_type|sensor_1_temp|sensor_1_humidity|sensor_1_light|sensor_1_co|
+#include <stddef.h>
+#include <type_traits>
 
-#define MAX_TOKEN_LENGTH 20  // Adjust the maximum token length as needed
+// Frame layout, one line per sample, comma separated decimals: the sensor
+// and fan channel counts, then the fields of each channel present, in
+// SENSOR_CHANNEL_FIELDS / FAN_CHANNEL_FIELDS order (see payload.h), then
+// the controller outputs:
+// |sensor_count|fan_count|
+// |type|temperature|humidity|light|CO2|            x sensor_count
+// |type|set_percent|speed|                         x fan_count
+// |relay_CO2|relay_programmable_1|relay_programmable_2|pwm_light|
+// Fixed-point fields (temperature, in degrees) always carry a decimal
+// point, every other field never does, e.g. with one sensor and no fans:
+//   1,0,1,-21.50,45,7,800,1,0,1,99
+// Binary frames carry the same values in the same order, packed by
+// payload_pack().
 
+static_assert(PAYLOAD_SENSOR_CHANNEL_LENGTH == 7 && PAYLOAD_FAN_CHANNEL_LENGTH == 4 && PAYLOAD_CONTROLLER_LENGTH == 4,
+              "serial binary layout changed, update the sensor MCU");
+static_assert(COBS_ENCODED_MAX_LENGTH(SERIAL_BINARY_FRAME_MAX_LENGTH) <= SERIAL_FRAME_MAX_LENGTH,
+              "frame buffer too small for a binary frame");
 
-void read_serial_port(payload_structure *ptr_payload_data) {
-  // Check if there is data available in the serial buffer
-  if (Serial.available() > 0) {
-    String receivedData = Serial.readStringUntil('\n');  // Read the string until a newline character is encountered
+static serial_rx_stats rx_stats;
 
-    // Process the received data
-    processData(receivedData, ptr_payload_data);
+// Frame assembly state. Bytes are moved out of the Serial RX buffer one at a
+// time, so a partial frame simply stays here until its terminator arrives.
+static uint8_t frame_buffer[SERIAL_FRAME_MAX_LENGTH];
+static size_t frame_length = 0;
+static bool frame_overflow = false;
+static bool frame_is_text = true;
+static bool frame_is_command = false;
+static bool frame_damaged = false;   // bytes of it may have been lost in the UART
+static bool frame_after_line = false;  // the previous frame ended with a line terminator
+static serial_command_handler command_handler = NULL;
+static serial_frame_handler frame_handler = NULL;
+
+typedef struct {
+  payload_slot slot;
+  int32_t value;
+} serial_tx_command;
+
+// Commands waiting for room in the UART TX FIFO, oldest first
+static serial_tx_command tx_queue[SERIAL_TX_QUEUE_LENGTH];
+static size_t tx_head = 0;
+static size_t tx_count = 0;
+
+#if SERIAL_PROTOCOL_MODE == SERIAL_PROTOCOL_AUTO
+static bool isTextFrameByte(int c) {
+  return (c >= '0' && c <= '9') || c == SERIAL_FRAME_SEPARATOR || c == '-' || c == SERIAL_FRAME_DECIMAL_POINT
+         || c == '\r';
+}
+#endif
+
+static void countResult(frame_parse_result result) {
+  switch (result) {
+    case FRAME_PARSE_OK: rx_stats.frames_ok++; break;
+    case FRAME_PARSE_ERROR_SYNTAX: rx_stats.errors_syntax++; break;
+    case FRAME_PARSE_ERROR_FIELD_COUNT: rx_stats.errors_field_count++; break;
+    case FRAME_PARSE_ERROR_OVERFLOW: rx_stats.errors_overflow++; break;
+    case FRAME_PARSE_ERROR_CRC: rx_stats.errors_crc++; break;
   }
+}
+
+// Publishes an accepted frame as the latest one, counts the outcome and
+// hands the frame to the frame handler
+static void frameDone(frame_parse_result result, payload_buffer *buffer, const payload_structure *frame) {
+  payload_buffer_write_end(buffer, result == FRAME_PARSE_OK);
+  countResult(result);
+  if (result == FRAME_PARSE_OK && frame_handler != NULL) {
+    frame_handler(frame);
+  }
+}
 
-  // Your non-blocking code can continue here
+static void resetFrame() {
+  frame_length = 0;
+  frame_overflow = false;
+  frame_is_text = true;
+  frame_is_command = false;
+  frame_damaged = false;
+  frame_after_line = false;
 }
 
-void processData(String data, payload_structure *ptr_payload_data) {
+void serial_set_command_handler(serial_command_handler handler) {
+  command_handler = handler;
+}
 
-int values[20];
+// Called with the payload after every frame that parsed, e.g. to aggregate
+void serial_set_frame_handler(serial_frame_handler handler) {
+  frame_handler = handler;
+}
 
-  // Tokenize the string using commas as separators
-char *token = strtok(const_cast<char*>(data.c_str()), ",");   // NOLINT
-  // Loop through each token and convert it to an integer
-  for (int i = 0; i < MAX_TOKEN_LENGTH && token != NULL; i++) {
-     values[i] = atoi(token);
-      token = strtok(NULL, ",");
+// Opens the sensor MCU link; call instead of Serial.begin().
+void serial_begin() {
+  // The ring is allocated by begin(), so its size has to be set first
+  Serial.setRxBufferSize(SERIAL_RX_BUFFER_SIZE);
+  Serial.begin(SERIAL_BAUD_RATE);
+#ifdef ARDUINO_ARCH_ESP8266
+  USC1(0) = (SERIAL_RX_FIFO_FULL_THRESHOLD << UCFFT) | (SERIAL_RX_FIFO_TIMEOUT << UCTOT) | (1 << UCTOE);
+#endif
 }
 
+// Every frame is parsed into the slot of buffer readers are not using.
+void read_serial_port(payload_buffer *buffer) {
+  // The lost bytes may belong to the frame being assembled, so it is
+  // dropped at its end; the parsers reject anything else they garbled.
+  if (Serial.hasOverrun()) {
+    rx_stats.overruns++;
+    frame_damaged = true;
+  }
+  if (Serial.hasRxError()) {
+    rx_stats.line_errors++;
+    frame_damaged = true;
+  }
+
+  // Consume at most SERIAL_RX_MAX_BYTES_PER_CALL bytes so the caller gets
+  // control back in bounded time even while the sensor MCU is streaming.
+  int budget = SERIAL_RX_MAX_BYTES_PER_CALL;
 
+  while (budget-- > 0 && Serial.available() > 0) {
+    int c = Serial.read();
+    if (c < 0) {
+      break;
+    }
 
-ptr_payload_data->sensor_1_type = values[0];
-ptr_payload_data->sensor_1_temperature = values[1];
-ptr_payload_data->sensors_1_humidity = values[2];
-ptr_payload_data->sensor_1_light = values[3];
-ptr_payload_data->sensor_1_CO2 = values[4];
+#if SERIAL_PROTOCOL_MODE != SERIAL_PROTOCOL_ASCII
+    if (c == SERIAL_COBS_DELIMITER) {
+      if (frame_overflow) {
+        rx_stats.frames_too_long++;
+      } else if (frame_length > 0 && !frame_damaged) {
+        uint32_t start = profiler_begin();
+        payload_structure *frame = payload_buffer_write_begin(buffer);
+        frameDone(processBinaryData(frame_buffer, frame_length, frame), buffer, frame);
+        profiler_end(PROFILE_PROCESS_DATA, start);
+      }
+      resetFrame();
+      continue;
+    }
+#endif
 
-      //
-ptr_payload_data->sensor_2_type = values[5];
-ptr_payload_data->sensor_2_temperature = values[6];
-ptr_payload_data->sensors_2_humidity = values[7];
-ptr_payload_data->sensor_2_light = values[8];
-ptr_payload_data->sensor_2_CO2 = values[9];
+#if SERIAL_PROTOCOL_MODE == SERIAL_PROTOCOL_AUTO
+    // The COBS code byte leading a binary frame is '\n' or '\r' when the
+    // first zero of the raw frame is at index 9 or 12. Only right after a
+    // line can such a byte be an empty line or a CR of one; otherwise, e.g.
+    // after a delimiter, it starts a binary frame.
+    if (frame_length == 0 && !frame_after_line && (c == SERIAL_FRAME_TERMINATOR || c == '\r')) {
+      frame_is_text = false;
+    }
+#endif
 
-ptr_payload_data->fan_1_type = values[10];
-ptr_payload_data->fan_1_set_percent = values[11];
-ptr_payload_data->fan_1_speed = values[12];
+#if SERIAL_PROTOCOL_MODE != SERIAL_PROTOCOL_BINARY
+    // Inside a binary frame '\n' is ordinary data; a line can only end one
+    // that has looked like text so far, or one already too long to be binary
+    // (line noise), so the receiver resynchronises on the next line.
+    if (c == SERIAL_FRAME_TERMINATOR
+        && (frame_is_text || frame_length >= COBS_ENCODED_MAX_LENGTH(SERIAL_BINARY_FRAME_MAX_LENGTH))) {
+      // Lines that did not fit in the buffer are dropped as a whole
+      if (frame_overflow) {
+        rx_stats.frames_too_long++;
+      } else if (frame_damaged) {
+        // Counted as an overrun or line error already
+      } else if (frame_length > 0 && frame_buffer[0] == SERIAL_COMMAND_PREFIX) {
+        if (command_handler != NULL) {
+          command_handler((const char *)frame_buffer + 1, frame_length - 1);
+        }
+      } else if (frame_length > 0) {
+        uint32_t start = profiler_begin();
+        payload_structure *frame = payload_buffer_write_begin(buffer);
+        frameDone(processData((const char *)frame_buffer, frame_length, frame), buffer, frame);
+        profiler_end(PROFILE_PROCESS_DATA, start);
+      }
+      resetFrame();
+      frame_after_line = true;
+      continue;
+    }
+    if (frame_is_text && c == '\r') {
+      continue;
+    }
+#endif
+
+#if SERIAL_PROTOCOL_MODE == SERIAL_PROTOCOL_AUTO
+    if (frame_length == 0 && c == SERIAL_COMMAND_PREFIX) {
+      frame_is_command = true;
+    }
+    frame_is_text = frame_is_text && (frame_is_command ? (c >= ' ' && c <= '~') : isTextFrameByte(c));
+#elif SERIAL_PROTOCOL_MODE == SERIAL_PROTOCOL_BINARY
+    frame_is_text = false;
+#endif
+
+    if (frame_length < SERIAL_FRAME_MAX_LENGTH) {
+      frame_buffer[frame_length++] = (uint8_t)c;
+    } else {
+      frame_overflow = true;
+    }
+  }
+}
 
-ptr_payload_data->fan_2_type = values[13];
-ptr_payload_data->fan_2_set_percent = values[14];
-ptr_payload_data->fan_2_speed = values[15];
+// Single pass over the frame: digits are accumulated as they are seen and
+// each value is range checked and stored when its separator is reached. The
+// two leading counts decide which fields follow, so the work is linear in
+// the channels actually sent. Fixed-point fields must be sent as a decimal
+// with 1 to `scale` digits after the point (-21.5 or -21.50), converted to
+// the raw integer without floats; a bare integer there (-2150 or 21) is a
+// syntax error, so a value can never be read at the wrong scale, and every
+// other field is a plain integer. The parsed sample is only committed
+// once every field was valid, so a truncated or corrupted line never leaves
+// a half-updated payload behind.
+frame_parse_result processData(const char *data, size_t length, payload_structure *ptr_payload_data) {
+  payload_structure parsed = *ptr_payload_data;
+  payload_cursor cursor;
+  int32_t sensor_count = 0;
+  size_t field = 0;
+  bool more = false;
+  int32_t value = 0;
+  bool negative = false;
+  bool has_digits = false;
+  int decimals = -1;  // digits after the decimal point, -1 before one is seen
+  int scale = 0;
 
-ptr_payload_data->relay_CO2 = values[16];
-ptr_payload_data->relay_programmable_1 = values[17];
-ptr_payload_data->relay_programmable_2 = values[18];
-ptr_payload_data->pwm_light = values[19];
+  for (size_t i = 0; i <= length; i++) {
+    char c = (i < length) ? data[i] : SERIAL_FRAME_SEPARATOR;
 
+    if (c >= '0' && c <= '9') {
+      if (decimals >= 0 && ++decimals > scale) {
+        return FRAME_PARSE_ERROR_SYNTAX;
+      }
+      value = value * 10 + (c - '0');
+      // Anything above 5 digits cannot fit an int16/uint16 field
+      if (value > 99999) {
+        return FRAME_PARSE_ERROR_OVERFLOW;
+      }
+      has_digits = true;
+    } else if (c == '-' && !has_digits && !negative) {
+      negative = true;
+    } else if (c == SERIAL_FRAME_DECIMAL_POINT && has_digits && decimals < 0) {
+      scale = (field >= 2 && more) ? payload_field(&cursor)->scale : 0;
+      if (scale == 0) {
+        return FRAME_PARSE_ERROR_SYNTAX;
+      }
+      decimals = 0;
+    } else if (c == SERIAL_FRAME_SEPARATOR) {
+      bool scaled = field >= 2 && more && payload_field(&cursor)->scale > 0;
+      if (!has_digits || decimals == 0 || (scaled && decimals < 0)) {
+        return FRAME_PARSE_ERROR_SYNTAX;
+      }
+      for (; decimals >= 0 && decimals < scale; decimals++) {
+        value *= 10;
+      }
+      if (negative) {
+        value = -value;
+      }
 
-}
\ No newline at end of file
+      if (field == 0) {
+        sensor_count = value;
+      } else if (field == 1) {
+        if (!payload_set_channels(&parsed, sensor_count, value)) {
+          return FRAME_PARSE_ERROR_FIELD_COUNT;
+        }
+        more = payload_begin(&parsed, &cursor);
+      } else {
+        if (!more) {
+          return FRAME_PARSE_ERROR_FIELD_COUNT;
+        }
+        if (!payload_set(&parsed, &cursor, value)) {
+          return FRAME_PARSE_ERROR_OVERFLOW;
+        }
+        more = payload_next(&parsed, &cursor);
+      }
+      field++;
+      value = 0;
+      negative = false;
+      has_digits = false;
+      decimals = -1;
+    } else {
+      return FRAME_PARSE_ERROR_SYNTAX;
+    }
+  }
+
+  if (field < 2 || more) {
+    return FRAME_PARSE_ERROR_FIELD_COUNT;
+  }
+
+  *ptr_payload_data = parsed;
+  return FRAME_PARSE_OK;
+}
+
+template <typename T>
+static uint8_t *packValue(uint8_t *out, T value) {
+  typename std::make_unsigned<T>::type bits = value;
+  for (size_t i = 0; i < sizeof(T); i++) {
+    *out++ = (uint8_t)(bits >> (8 * i));
+  }
+  return out;
+}
+
+// Decodes one COBS frame (without its delimiter) in place.
+frame_parse_result processBinaryData(uint8_t *data, size_t length, payload_structure *ptr_payload_data) {
+  size_t decoded_length = cobs_decode(data, length, data);
+
+  if (decoded_length < 3) {
+    return FRAME_PARSE_ERROR_CRC;
+  }
+
+  size_t body_length = decoded_length - 2;
+  uint16_t crc = (uint16_t)(data[body_length] | (data[body_length + 1] << 8));
+  if (crc16_ccitt(data, body_length) != crc) {
+    return FRAME_PARSE_ERROR_CRC;
+  }
+
+  if (data[0] != SERIAL_FRAME_TYPE_CHANNELS) {
+    return FRAME_PARSE_ERROR_SYNTAX;
+  }
+  // The counts must describe exactly the fields that follow
+  if (body_length < 1 + PAYLOAD_HEADER_LENGTH || body_length - 1 != PAYLOAD_PACKED_LENGTH(data[1], data[2])
+      || payload_unpack(data + 1, body_length - 1, ptr_payload_data) == 0) {
+    return FRAME_PARSE_ERROR_FIELD_COUNT;
+  }
+  return FRAME_PARSE_OK;
+}
+
+// Builds a complete wire frame, delimiter included. This is what the sensor
+// MCU sends; it lives here so both ends share one definition of the layout.
+size_t encodeBinaryFrame(const payload_structure *ptr_payload_data, uint8_t *out, size_t size) {
+  uint8_t frame[SERIAL_BINARY_FRAME_MAX_LENGTH];
+  size_t frame_length = 1 + payload_packed_length(ptr_payload_data) + 2;
+
+  if (size < COBS_ENCODED_MAX_LENGTH(frame_length) + 1) {
+    return 0;
+  }
+
+  frame[0] = SERIAL_FRAME_TYPE_CHANNELS;
+  size_t body_length = 1 + payload_pack(ptr_payload_data, frame + 1);
+
+  uint16_t crc = crc16_ccitt(frame, body_length);
+  frame[body_length] = (uint8_t)crc;
+  frame[body_length + 1] = (uint8_t)(crc >> 8);
+
+  size_t length = cobs_encode(frame, frame_length, out);
+  out[length++] = SERIAL_COBS_DELIMITER;
+  return length;
+}
+
+const serial_rx_stats *serial_rx_get_stats() {
+  return &rx_stats;
+}
+
+static_assert(COBS_ENCODED_MAX_LENGTH(SERIAL_SET_FRAME_LENGTH) + 1 <= SERIAL_SET_LINE_MAX_LENGTH,
+              "set command line buffer too small for a binary frame");
+
+// Builds one set command in the link's wire format, delimiter or
+// terminator included. Returns 0 if out is too small.
+size_t encodeSetCommand(payload_slot slot, int32_t value, uint8_t *out, size_t size) {
+#if SERIAL_PROTOCOL_MODE == SERIAL_PROTOCOL_BINARY
+  uint8_t frame[SERIAL_SET_FRAME_LENGTH];
+
+  if (size < COBS_ENCODED_MAX_LENGTH(SERIAL_SET_FRAME_LENGTH) + 1) {
+    return 0;
+  }
+
+  frame[0] = SERIAL_FRAME_TYPE_SET;
+  packValue(frame + 1, slot);
+  packValue(frame + 3, value);
+
+  uint16_t crc = crc16_ccitt(frame, 7);
+  frame[7] = (uint8_t)crc;
+  frame[8] = (uint8_t)(crc >> 8);
+
+  size_t length = cobs_encode(frame, sizeof(frame), out);
+  out[length++] = SERIAL_COBS_DELIMITER;
+  return length;
+#else
+  int length = snprintf((char *)out, size, "%c%u,%ld\n", SERIAL_SET_COMMAND_PREFIX, (unsigned)slot, (long)value);
+  return (length > 0 && (size_t)length < size) ? (size_t)length : 0;
+#endif
+}
+
+// Queues a command for the sensor MCU. A command for a slot that is still
+// queued replaces the older value. Returns false when the queue is full.
+bool serial_queue_command(payload_slot slot, int32_t value) {
+  for (size_t i = 0; i < tx_count; i++) {
+    serial_tx_command *queued = &tx_queue[(tx_head + i) % SERIAL_TX_QUEUE_LENGTH];
+    if (queued->slot == slot) {
+      queued->value = value;
+      return true;
+    }
+  }
+
+  if (tx_count == SERIAL_TX_QUEUE_LENGTH) {
+    return false;
+  }
+  tx_queue[(tx_head + tx_count) % SERIAL_TX_QUEUE_LENGTH] = { slot, value };
+  tx_count++;
+  return true;
+}
+
+// true if a command for slot is waiting, so queueing another one only
+// replaces its value
+bool serial_command_queued(payload_slot slot) {
+  for (size_t i = 0; i < tx_count; i++) {
+    if (tx_queue[(tx_head + i) % SERIAL_TX_QUEUE_LENGTH].slot == slot) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Commands serial_queue_command() still takes before the queue is full
+size_t serial_command_space() {
+  return SERIAL_TX_QUEUE_LENGTH - tx_count;
+}
+
+// Drops the queued commands unsent
+void serial_discard_commands() {
+  tx_head = 0;
+  tx_count = 0;
+}
+
+// Writes queued commands while they fit in the TX FIFO; the rest waits for
+// the next call.
+void serial_flush_commands() {
+  uint8_t line[SERIAL_SET_LINE_MAX_LENGTH + 1];
+
+  while (tx_count > 0) {
+    const serial_tx_command *command = &tx_queue[tx_head];
+    size_t length = encodeSetCommand(command->slot, command->value, line, sizeof(line));
+
+    if (length > 0 && (size_t)Serial.availableForWrite() < length) {
+      return;
+    }
+    if (length > 0) {
+      Serial.write(line, length);
+    }
+    tx_head = (tx_head + 1) % SERIAL_TX_QUEUE_LENGTH;
+    tx_count--;
+  }
+}
@@ -0,0 +1,111 @@
+#include <profiler.h>
+
+typedef struct {
+  uint32_t count;
+  uint32_t min_cycles;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+  uint32_t buckets[PROFILER_BUCKETS];
+} stage_profile;
+
+static const char *const stage_names[PROFILE_STAGE_COUNT] = {
+  "serial_read",
+  "process_data",
+  "telemetry_payload",
+  "publish_topic",
+  "mqtt_publish",
+  "mqtt_loop",
+};
+
+static stage_profile profiles[PROFILE_STAGE_COUNT];
+
+#if PROFILER_ENABLED
+
+void profiler_end(profile_stage stage, uint32_t start_cycles) {
+  // Unsigned subtraction handles the 32 bit cycle counter wrapping
+  uint32_t cycles = ESP.getCycleCount() - start_cycles;
+  stage_profile *profile = &profiles[stage];
+
+  if (profile->count == 0 || cycles < profile->min_cycles) {
+    profile->min_cycles = cycles;
+  }
+  if (cycles > profile->max_cycles) {
+    profile->max_cycles = cycles;
+  }
+  profile->count++;
+  profile->total_cycles += cycles;
+
+  uint32_t bucket = 31 - __builtin_clz(cycles | 1);
+  if (bucket >= PROFILER_BUCKETS) {
+    bucket = PROFILER_BUCKETS - 1;
+  }
+  profile->buckets[bucket]++;
+}
+
+#endif
+
+void profiler_reset() {
+  memset(profiles, 0, sizeof(profiles));
+}
+
+static uint32_t cyclesToUs(uint64_t cycles) {
+  return (uint32_t)(cycles / ESP.getCpuFreqMHz());
+}
+
+// Upper edge of the bucket holding the 99th percentile, capped at the
+// observed maximum.
+static uint32_t p99Cycles(const stage_profile *profile) {
+  uint32_t threshold = profile->count - profile->count / 100;
+  uint32_t seen = 0;
+
+  for (uint32_t bucket = 0; bucket < PROFILER_BUCKETS; bucket++) {
+    seen += profile->buckets[bucket];
+    if (seen >= threshold) {
+      uint64_t upper = (uint64_t)2 << bucket;
+      return upper < profile->max_cycles ? (uint32_t)upper : profile->max_cycles;
+    }
+  }
+  return profile->max_cycles;
+}
+
+void profiler_dump(Print &out) {
+  out.println("stage                 count    min_us    avg_us    p99_us    max_us");
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    const stage_profile *profile = &profiles[stage];
+    char line[96];
+
+    snprintf(line, sizeof(line), "%-18s %8lu %9lu %9lu %9lu %9lu",
+             stage_names[stage],
+             (unsigned long)profile->count,
+             (unsigned long)cyclesToUs(profile->min_cycles),
+             (unsigned long)(profile->count ? cyclesToUs(profile->total_cycles / profile->count) : 0),
+             (unsigned long)cyclesToUs(p99Cycles(profile)),
+             (unsigned long)cyclesToUs(profile->max_cycles));
+    out.println(line);
+  }
+}
+
+static az_span writeU32(az_span out, uint32_t value, bool last) {
+  (void)az_span_u32toa(out, value, &out);
+  return az_span_copy_u8(out, last ? ']' : ',');
+}
+
+// Writes `"profile": { "<stage>": [count, minUs, avgUs, p99Us, maxUs], ... }`
+az_span profiler_write_json(az_span destination) {
+  az_span out = az_span_copy(destination, AZ_SPAN_FROM_STR("\"profile\": {"));
+
+  for (int stage = 0; stage < PROFILE_STAGE_COUNT; stage++) {
+    const stage_profile *profile = &profiles[stage];
+
+    out = az_span_copy(out, stage == 0 ? AZ_SPAN_FROM_STR(" \"") : AZ_SPAN_FROM_STR(", \""));
+    out = az_span_copy(out, az_span_create((uint8_t *)stage_names[stage], strlen(stage_names[stage])));
+    out = az_span_copy(out, AZ_SPAN_FROM_STR("\": ["));
+    out = writeU32(out, profile->count, false);
+    out = writeU32(out, cyclesToUs(profile->min_cycles), false);
+    out = writeU32(out, profile->count ? cyclesToUs(profile->total_cycles / profile->count) : 0, false);
+    out = writeU32(out, cyclesToUs(p99Cycles(profile)), false);
+    out = writeU32(out, cyclesToUs(profile->max_cycles), true);
+  }
+
+  return az_span_copy(out, AZ_SPAN_FROM_STR(" }"));
+}
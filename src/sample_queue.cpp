@@ -0,0 +1,359 @@
+#include <sample_queue.h>
+
+#include <LittleFS.h>
+
+#define SPILL_LOG_PATH "/records.bin"
+#define SPILL_INDEX_PATH "/records.idx"
+
+// Record: total length (u16), timestamp (u32), frame count (u16), then
+// mean, min and max, each packed by payload_pack() with the same channels.
+#define RECORD_HEADER_LENGTH (2 + 4 + 2)
+#define RECORD_MIN_LENGTH (RECORD_HEADER_LENGTH + 3 * PAYLOAD_PACKED_LENGTH(0, 0))
+#define RECORD_MAX_LENGTH (RECORD_HEADER_LENGTH + 3 * PAYLOAD_PACKED_MAX_LENGTH)
+
+static_assert(SAMPLE_QUEUE_RAM_BYTES >= RECORD_MAX_LENGTH, "RAM ring cannot hold a sample with every channel");
+
+// Logs of earlier record formats, dropped at mount
+static const char *const legacy_paths[] = { "/queue.bin", "/queue.idx", "/samples.bin", "/samples.idx" };
+
+static uint8_t ram_ring[SAMPLE_QUEUE_RAM_BYTES];
+static size_t ram_tail = 0;   // offset of the oldest record
+static size_t ram_used = 0;   // bytes held, records may wrap around the end
+static size_t ram_count = 0;
+
+// One record being encoded or decoded
+static uint8_t record_buffer[RECORD_MAX_LENGTH];
+
+static bool flash_ready = false;
+static uint32_t flash_size = 0;         // bytes in the spill log
+static uint32_t flash_read_offset = 0;  // first record not yet drained
+static size_t flash_count = 0;          // records from flash_read_offset on
+static size_t cursor_index = 0;         // a record counted from flash_read_offset,
+static uint32_t cursor_offset = 0;      // and where it starts, so peeks walk forward only
+static uint32_t pops_since_sync = 0;
+
+static sample_queue_stats queue_stats;
+
+static size_t encodeRecord(const telemetry_sample *sample, uint8_t *record) {
+  size_t length = RECORD_HEADER_LENGTH;
+
+  memcpy(record + 2, &sample->timestamp, 4);
+  memcpy(record + 6, &sample->frame_count, 2);
+  length += payload_pack(&sample->payload, record + length);
+  length += payload_pack(&sample->payload_min, record + length);
+  length += payload_pack(&sample->payload_max, record + length);
+  record[0] = (uint8_t)length;
+  record[1] = (uint8_t)(length >> 8);
+  return length;
+}
+
+static size_t recordLength(const uint8_t *record) {
+  return record[0] | (record[1] << 8);
+}
+
+static bool decodeRecord(const uint8_t *record, size_t length, telemetry_sample *sample) {
+  payload_structure *parts[] = { &sample->payload, &sample->payload_min, &sample->payload_max };
+  size_t offset = RECORD_HEADER_LENGTH;
+
+  if (length < RECORD_MIN_LENGTH || recordLength(record) != length) {
+    return false;
+  }
+  memcpy(&sample->timestamp, record + 2, 4);
+  memcpy(&sample->frame_count, record + 6, 2);
+  for (size_t i = 0; i < 3; i++) {
+    size_t used = payload_unpack(record + offset, length - offset, parts[i]);
+    if (used == 0) {
+      return false;
+    }
+    offset += used;
+  }
+  return offset == length && payload_same_channels(&sample->payload, &sample->payload_min)
+         && payload_same_channels(&sample->payload, &sample->payload_max);
+}
+
+// Byte access to the RAM ring, offset counted from the oldest record
+static void ringRead(size_t offset, uint8_t *out, size_t length) {
+  size_t start = (ram_tail + offset) % SAMPLE_QUEUE_RAM_BYTES;
+  size_t first = length < SAMPLE_QUEUE_RAM_BYTES - start ? length : SAMPLE_QUEUE_RAM_BYTES - start;
+  memcpy(out, ram_ring + start, first);
+  memcpy(out + first, ram_ring, length - first);
+}
+
+static void ringWrite(size_t offset, const uint8_t *in, size_t length) {
+  size_t start = (ram_tail + offset) % SAMPLE_QUEUE_RAM_BYTES;
+  size_t first = length < SAMPLE_QUEUE_RAM_BYTES - start ? length : SAMPLE_QUEUE_RAM_BYTES - start;
+  memcpy(ram_ring + start, in, first);
+  memcpy(ram_ring, in + first, length - first);
+}
+
+static size_t ringRecordLength(size_t offset) {
+  uint8_t header[2];
+  ringRead(offset, header, sizeof(header));
+  return recordLength(header);
+}
+
+static void ringDropOldest() {
+  size_t length = ringRecordLength(0);
+  ram_tail = (ram_tail + length) % SAMPLE_QUEUE_RAM_BYTES;
+  ram_used -= length;
+  ram_count--;
+}
+
+static void writeIndex() {
+  File index = LittleFS.open(SPILL_INDEX_PATH, "w");
+  if (!index) {
+    queue_stats.flash_errors++;
+    return;
+  }
+  index.write((const uint8_t *)&flash_read_offset, sizeof(flash_read_offset));
+  index.close();
+  pops_since_sync = 0;
+}
+
+static void clearSpillLog() {
+  LittleFS.remove(SPILL_LOG_PATH);
+  LittleFS.remove(SPILL_INDEX_PATH);
+  flash_size = 0;
+  flash_read_offset = 0;
+  flash_count = 0;
+  pops_since_sync = 0;
+  cursor_index = 0;
+  cursor_offset = 0;
+}
+
+// Length of the log record at offset, 0 if there is no valid one
+static size_t readFlashRecordLength(File &log, uint32_t offset) {
+  uint8_t header[2];
+
+  if (offset + RECORD_MIN_LENGTH > flash_size || !log.seek(offset, SeekSet) || log.read(header, 2) != 2) {
+    return 0;
+  }
+  size_t length = recordLength(header);
+  return (length >= RECORD_MIN_LENGTH && length <= RECORD_MAX_LENGTH && offset + length <= flash_size) ? length : 0;
+}
+
+// Walks to the record count after flash_read_offset, from the cursor when
+// it is not past it; false if the log is damaged
+static bool skipFlashRecords(File &log, size_t count, uint32_t *offset) {
+  size_t index = 0;
+
+  *offset = flash_read_offset;
+  if (count >= cursor_index) {
+    index = cursor_index;
+    *offset = cursor_offset;
+  }
+  for (; index < count; index++) {
+    size_t length = readFlashRecordLength(log, *offset);
+    if (length == 0) {
+      return false;
+    }
+    *offset += length;
+  }
+  cursor_index = count;
+  cursor_offset = *offset;
+  return true;
+}
+
+// Moves the oldest RAM record to flash as is, without an extra copy.
+static bool spillOldest() {
+  size_t length = ringRecordLength(0);
+
+  if (!flash_ready || flash_size + length > SAMPLE_QUEUE_FLASH_MAX_BYTES) {
+    return false;
+  }
+
+  File log = LittleFS.open(SPILL_LOG_PATH, "a");
+  if (!log) {
+    queue_stats.flash_errors++;
+    return false;
+  }
+  size_t first = length < SAMPLE_QUEUE_RAM_BYTES - ram_tail ? length : SAMPLE_QUEUE_RAM_BYTES - ram_tail;
+  size_t written = log.write(ram_ring + ram_tail, first);
+  if (written == first && first < length) {
+    written += log.write(ram_ring, length - first);
+  }
+  if (written != length) {
+    // Cut a partial record off again so later records stay aligned
+    log.truncate(flash_size);
+    log.close();
+    queue_stats.flash_errors++;
+    return false;
+  }
+  log.close();
+
+  flash_size += length;
+  flash_count++;
+  queue_stats.spilled++;
+  return true;
+}
+
+static bool readFlashRecord(size_t index, telemetry_sample *sample) {
+  File log = LittleFS.open(SPILL_LOG_PATH, "r");
+  uint32_t offset;
+  size_t length = 0;
+
+  bool ok = log && skipFlashRecords(log, index, &offset) && (length = readFlashRecordLength(log, offset)) > 0
+            && log.seek(offset, SeekSet) && log.read(record_buffer, length) == length;
+  if (log) {
+    log.close();
+  }
+  if (!ok || !decodeRecord(record_buffer, length, sample)) {
+    queue_stats.flash_errors++;
+    return false;
+  }
+  return true;
+}
+
+// Mounts the filesystem and picks up samples spilled before a reset.
+bool sample_queue_init() {
+  flash_ready = LittleFS.begin();
+  if (!flash_ready) {
+    return false;
+  }
+  for (size_t i = 0; i < sizeof(legacy_paths) / sizeof(legacy_paths[0]); i++) {
+    LittleFS.remove(legacy_paths[i]);
+  }
+
+  uint32_t saved_offset = 0;
+  File index = LittleFS.open(SPILL_INDEX_PATH, "r");
+  if (index) {
+    if (index.read((uint8_t *)&saved_offset, sizeof(saved_offset)) != sizeof(saved_offset)) {
+      saved_offset = 0;
+    }
+    index.close();
+  }
+
+  // One pass over the record lengths: counts the records after the saved
+  // read offset, which must fall on a record boundary, and ignores a torn
+  // trailing record from a power loss
+  File log = LittleFS.open(SPILL_LOG_PATH, "r");
+  if (log) {
+    size_t records = 0;
+    size_t after_saved = 0;
+    bool saved_is_boundary = saved_offset == 0;
+    uint32_t offset = 0;
+    size_t length;
+
+    flash_size = log.size();
+    while ((length = readFlashRecordLength(log, offset)) > 0) {
+      records++;
+      offset += length;
+      if (offset == saved_offset) {
+        saved_is_boundary = true;
+      } else if (offset > saved_offset) {
+        after_saved++;
+      }
+    }
+    log.close();
+
+    // Appends go to the end of the file, so torn bytes left there would
+    // misalign every record spilled after them; if they cannot be cut off
+    // the log is dropped
+    if (offset != flash_size) {
+      queue_stats.flash_errors++;
+      File torn = LittleFS.open(SPILL_LOG_PATH, "r+");
+      if (!torn || !torn.truncate(offset)) {
+        records = 0;
+        after_saved = 0;
+      }
+      if (torn) {
+        torn.close();
+      }
+    }
+
+    flash_size = offset;
+    flash_read_offset = saved_is_boundary ? saved_offset : 0;
+    flash_count = saved_is_boundary ? after_saved : records;
+    cursor_index = 0;
+    cursor_offset = flash_read_offset;
+  }
+
+  if (flash_count == 0) {
+    clearSpillLog();
+  }
+  return true;
+}
+
+void sample_queue_push(const telemetry_sample *sample) {
+  size_t length = encodeRecord(sample, record_buffer);
+
+  while (SAMPLE_QUEUE_RAM_BYTES - ram_used < length) {
+    // The oldest RAM sample moves to flash, or is lost if flash is full too
+    if (!spillOldest()) {
+      queue_stats.dropped++;
+    }
+    ringDropOldest();
+  }
+
+  ringWrite(ram_used, record_buffer, length);
+  ram_used += length;
+  ram_count++;
+  queue_stats.pushed++;
+}
+
+// Index 0 is the oldest queued sample.
+bool sample_queue_peek(size_t index, telemetry_sample *sample) {
+  if (index < flash_count) {
+    if (readFlashRecord(index, sample)) {
+      return true;
+    }
+    // Unreadable log: give up on it rather than stalling the queue. That
+    // moves every index, so the peek fails and the caller has to start its
+    // batch over from the new count.
+    clearSpillLog();
+    return false;
+  }
+
+  index -= flash_count;
+  if (index >= ram_count) {
+    return false;
+  }
+
+  size_t offset = 0;
+  while (index-- > 0) {
+    offset += ringRecordLength(offset);
+  }
+  size_t length = ringRecordLength(offset);
+  ringRead(offset, record_buffer, length);
+  return decodeRecord(record_buffer, length, sample);
+}
+
+// Removes the oldest count samples.
+void sample_queue_pop(size_t count) {
+  size_t from_flash = count < flash_count ? count : flash_count;
+
+  if (from_flash > 0) {
+    File log = LittleFS.open(SPILL_LOG_PATH, "r");
+    uint32_t offset;
+    bool ok = log && skipFlashRecords(log, from_flash, &offset);
+    if (log) {
+      log.close();
+    }
+
+    flash_count -= from_flash;
+    pops_since_sync += from_flash;
+    if (!ok || flash_count == 0) {
+      clearSpillLog();
+    } else {
+      flash_read_offset = offset;
+      cursor_index = 0;
+      cursor_offset = offset;
+      if (pops_since_sync >= SAMPLE_QUEUE_INDEX_SYNC_EVERY) {
+        writeIndex();
+      }
+    }
+    count -= from_flash;
+  }
+
+  while (count-- > 0 && ram_count > 0) {
+    ringDropOldest();
+  }
+}
+
+size_t sample_queue_count() {
+  return flash_count + ram_count;
+}
+
+const sample_queue_stats *sample_queue_get_stats() {
+  return &queue_stats;
+}
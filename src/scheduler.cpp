@@ -0,0 +1,102 @@
+#include <scheduler.h>
+
+// Table registered by scheduler_init(), for reporting
+static scheduler_task *registered_tasks = NULL;
+static size_t registered_count = 0;
+
+static bool isDue(const scheduler_task *task, uint32_t now) {
+  return (int32_t)(now - task->next_run_ms) >= 0;
+}
+
+void scheduler_init(scheduler_task *tasks, size_t count) {
+  uint32_t now = millis();
+
+  for (size_t i = 0; i < count; i++) {
+    tasks[i].next_run_ms = now;
+    tasks[i].run_count = 0;
+    tasks[i].deadline_misses = 0;
+  }
+  registered_tasks = tasks;
+  registered_count = count;
+}
+
+// Runs every task that is due, then waits until the earliest next release
+// (capped at SCHEDULER_MAX_IDLE_MS). delay() lets the SDK service WiFi while
+// we wait. Returns the time spent in tasks, in microseconds.
+uint32_t scheduler_run(scheduler_task *tasks, size_t count) {
+  uint32_t start_us = micros();
+  uint32_t now = millis();
+
+  for (size_t i = 0; i < count; i++) {
+    scheduler_task *task = &tasks[i];
+    if (!isDue(task, now)) {
+      continue;
+    }
+
+    if ((uint32_t)(now - task->next_run_ms) > task->deadline_ms) {
+      task->deadline_misses++;
+    }
+
+    task->callback();
+    task->run_count++;
+    task->next_run_ms += task->period_ms;
+
+    // A task that fell behind by more than a period is re-phased instead of
+    // being run back to back to catch up.
+    now = millis();
+    if (task->period_ms > 0 && isDue(task, now)) {
+      task->next_run_ms = now + task->period_ms;
+    }
+  }
+
+  uint32_t busy_us = micros() - start_us;
+
+  uint32_t idle_ms = SCHEDULER_MAX_IDLE_MS;
+  for (size_t i = 0; i < count; i++) {
+    int32_t until_release = (int32_t)(tasks[i].next_run_ms - now);
+    if (until_release <= 0) {
+      idle_ms = 0;
+      break;
+    }
+    if ((uint32_t)until_release < idle_ms) {
+      idle_ms = until_release;
+    }
+  }
+
+  if (idle_ms > 0) {
+    delay(idle_ms);
+  } else {
+    yield();
+  }
+  return busy_us;
+}
+
+// Looks a task up by name in the registered table, NULL if there is none
+scheduler_task *scheduler_find(const char *name) {
+  for (size_t i = 0; i < registered_count; i++) {
+    if (strcmp(registered_tasks[i].name, name) == 0) {
+      return &registered_tasks[i];
+    }
+  }
+  return NULL;
+}
+
+// Takes effect from the next release; a shorter period also pulls a
+// pending release forward so the change is not delayed by the old period.
+void scheduler_set_period(scheduler_task *task, uint32_t period_ms) {
+  uint32_t next_release = millis() + period_ms;
+
+  task->period_ms = period_ms;
+  if ((int32_t)(task->next_run_ms - next_release) > 0) {
+    task->next_run_ms = next_release;
+  }
+}
+
+uint32_t scheduler_total_deadline_misses() {
+  uint32_t misses = 0;
+
+  for (size_t i = 0; i < registered_count; i++) {
+    misses += registered_tasks[i].deadline_misses;
+  }
+  return misses;
+}
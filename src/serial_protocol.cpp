@@ -0,0 +1,62 @@
+#include <serial_protocol.h>
+
+// Returns the encoded length. dst must hold COBS_ENCODED_MAX_LENGTH(length)
+// bytes and must not overlap src. The delimiter is not appended.
+size_t cobs_encode(const uint8_t *src, size_t length, uint8_t *dst) {
+  size_t code_index = 0;
+  size_t out = 1;
+  uint8_t code = 1;
+
+  for (size_t i = 0; i < length; i++) {
+    if (src[i] == 0) {
+      dst[code_index] = code;
+      code_index = out++;
+      code = 1;
+    } else {
+      dst[out++] = src[i];
+      code++;
+      if (code == 0xFF) {
+        dst[code_index] = code;
+        code_index = out++;
+        code = 1;
+      }
+    }
+  }
+  dst[code_index] = code;
+
+  return out;
+}
+
+// Returns the decoded length, or 0 if the input is not valid COBS.
+// Decoding in place (dst == src) is supported.
+size_t cobs_decode(const uint8_t *src, size_t length, uint8_t *dst) {
+  size_t in = 0;
+  size_t out = 0;
+
+  while (in < length) {
+    uint8_t code = src[in++];
+    if (code == 0 || in + code - 1 > length) {
+      return 0;
+    }
+    for (uint8_t i = 1; i < code; i++) {
+      dst[out++] = src[in++];
+    }
+    if (code != 0xFF && in < length) {
+      dst[out++] = 0;
+    }
+  }
+
+  return out;
+}
+
+uint16_t crc16_ccitt(const uint8_t *data, size_t length, uint16_t crc) {
+  // Table-less byte-wise form of the 0x1021 polynomial
+  for (size_t i = 0; i < length; i++) {
+    crc = (uint16_t)((crc >> 8) | (crc << 8));
+    crc ^= data[i];
+    crc ^= (uint8_t)(crc & 0xFF) >> 4;
+    crc ^= (uint16_t)(crc << 12);
+    crc ^= (uint16_t)((crc & 0xFF) << 5);
+  }
+  return crc;
+}
@@ -0,0 +1,193 @@
+#include <soak_bench.h>
+
+#include <logger.h>
+#include <processing_functions.h>
+
+static_assert(!BENCH_ENABLED || LOG_SINK != LOG_SINK_SERIAL, "the bench log cannot share UART0 with the frames");
+
+typedef struct {
+  uint32_t started_ms;
+  uint32_t frames_generated;
+  uint32_t frames_skipped;
+  uint32_t publishes;
+  uint32_t publish_failures;
+  uint64_t latency_total_us;  // of the publishes since the last report
+  uint32_t latency_max_us;
+  uint32_t heap_free_min;
+  uint32_t heap_max_block_min;
+  uint8_t heap_fragmentation_max;
+} soak_bench_state;
+
+static soak_bench_state bench = { 0, 0, 0, 0, 0, 0, 0, UINT32_MAX, UINT32_MAX, 0 };
+
+// Values of the previous report, for the rates over its window
+static uint32_t window_started_ms = 0;
+static uint32_t window_generated = 0;
+static uint32_t window_parsed = 0;
+static uint32_t window_publishes = 0;
+
+// Frame being written, TX FIFO space permitting
+static uint8_t frame[SERIAL_FRAME_MAX_LENGTH + 1];
+static size_t frame_length = 0;
+static size_t frame_sent = 0;
+
+static payload_structure synthetic;
+
+// Every field walks its whole range, each slot at its own phase
+static void nextPayload(uint32_t sequence) {
+  payload_cursor cursor;
+
+  payload_set_channels(&synthetic, BENCH_SENSORS, BENCH_FANS);
+  for (bool more = payload_begin(&synthetic, &cursor); more; more = payload_next(&synthetic, &cursor)) {
+    const payload_field_info *field = payload_field(&cursor);
+    uint32_t span = (uint32_t)(field->max - field->min) + 1;
+    payload_set(&synthetic, &cursor, field->min + (int32_t)((sequence * 7 + cursor.slot * 37) % span));
+  }
+}
+
+// Fixed-point fields as a decimal with all of their digits, as the MCU sends them
+static az_span writeField(az_span free, int32_t value, uint8_t scale) {
+  uint32_t divisor = 1;
+
+  if (scale == 0) {
+    (void)az_span_i32toa(free, value, &free);
+    return free;
+  }
+  if (value < 0) {
+    free = az_span_copy_u8(free, '-');
+  }
+  uint32_t magnitude = value < 0 ? (uint32_t)-(int64_t)value : (uint32_t)value;
+  for (uint8_t i = 0; i < scale; i++) {
+    divisor *= 10;
+  }
+  (void)az_span_u32toa(free, magnitude / divisor, &free);
+  free = az_span_copy_u8(free, SERIAL_FRAME_DECIMAL_POINT);
+  for (uint32_t digit = divisor / 10; digit > 0; digit /= 10) {
+    free = az_span_copy_u8(free, (uint8_t)('0' + magnitude / digit % 10));
+  }
+  return free;
+}
+
+static size_t encodeAsciiFrame(const payload_structure *payload, uint8_t *out, size_t size) {
+  az_span free = az_span_create(out, (int32_t)size);
+  payload_cursor cursor;
+
+  (void)az_span_u32toa(free, payload->sensor_count, &free);
+  free = az_span_copy_u8(free, SERIAL_FRAME_SEPARATOR);
+  (void)az_span_u32toa(free, payload->fan_count, &free);
+  for (bool more = payload_begin(payload, &cursor); more; more = payload_next(payload, &cursor)) {
+    free = az_span_copy_u8(free, SERIAL_FRAME_SEPARATOR);
+    free = writeField(free, payload_get(payload, &cursor), payload_field(&cursor)->scale);
+  }
+  free = az_span_copy_u8(free, SERIAL_FRAME_TERMINATOR);
+  return size - az_span_size(free);
+}
+
+// Loops UART0 back on itself, so nothing from the sensor MCU gets in.
+void soak_bench_begin() {
+#ifdef ARDUINO_ARCH_ESP8266
+  USC0(0) |= (1 << UCLBE);
+#endif
+  bench.started_ms = millis();
+  window_started_ms = bench.started_ms;
+}
+
+// Writes the frames due at BENCH_FRAME_RATE_HZ, a FIFO's worth at a time.
+void soak_bench_feed() {
+  size_t room = (size_t)Serial.availableForWrite();
+
+  while (room > 0) {
+    if (frame_sent == frame_length) {
+      uint32_t due = (uint32_t)((uint64_t)(millis() - bench.started_ms) * BENCH_FRAME_RATE_HZ / 1000);
+      uint32_t sent = bench.frames_generated + bench.frames_skipped;
+      if (due == sent) {
+        return;
+      }
+      if (due - sent > BENCH_MAX_BACKLOG_FRAMES) {
+        bench.frames_skipped += due - sent - 1;
+      }
+      nextPayload(bench.frames_generated);
+#if SERIAL_PROTOCOL_MODE == SERIAL_PROTOCOL_BINARY
+      frame_length = encodeBinaryFrame(&synthetic, frame, sizeof(frame));
+#else
+      frame_length = encodeAsciiFrame(&synthetic, frame, sizeof(frame));
+#endif
+      frame_sent = 0;
+      bench.frames_generated++;
+    }
+
+    size_t chunk = frame_length - frame_sent < room ? frame_length - frame_sent : room;
+    Serial.write(frame + frame_sent, chunk);
+    frame_sent += chunk;
+    room -= chunk;
+  }
+}
+
+// Time from beginPublish() to the end of the streamed message
+void soak_bench_publish(uint32_t latency_us, bool published) {
+  if (!published) {
+    bench.publish_failures++;
+    return;
+  }
+  bench.publishes++;
+  bench.latency_total_us += latency_us;
+  if (latency_us > bench.latency_max_us) {
+    bench.latency_max_us = latency_us;
+  }
+}
+
+// Heap low-water marks over the whole soak, unlike the health report's
+void soak_bench_sample() {
+  uint32_t heap_free = ESP.getFreeHeap();
+  uint32_t max_block = ESP.getMaxFreeBlockSize();
+  uint8_t fragmentation = ESP.getHeapFragmentation();
+
+  if (heap_free < bench.heap_free_min) {
+    bench.heap_free_min = heap_free;
+  }
+  if (max_block < bench.heap_max_block_min) {
+    bench.heap_max_block_min = max_block;
+  }
+  if (fragmentation > bench.heap_fragmentation_max) {
+    bench.heap_fragmentation_max = fragmentation;
+  }
+}
+
+// Hundredths of events per second
+static uint32_t ratePerSecond(uint32_t events, uint32_t elapsed_ms) {
+  return elapsed_ms == 0 ? 0 : (uint32_t)((uint64_t)events * 100000 / elapsed_ms);
+}
+
+void soak_bench_report() {
+  const serial_rx_stats *rx = serial_rx_get_stats();
+  uint32_t now_ms = millis();
+  uint32_t elapsed_ms = now_ms - window_started_ms;
+  uint32_t generated = bench.frames_generated - window_generated;
+  uint32_t parsed = rx->frames_ok - window_parsed;
+  uint32_t publishes = bench.publishes - window_publishes;
+  uint32_t generate_rate = ratePerSecond(generated, elapsed_ms);
+  uint32_t parse_rate = ratePerSecond(parsed, elapsed_ms);
+  uint32_t sustained = ratePerSecond(rx->frames_ok, now_ms - bench.started_ms);
+
+  soak_bench_sample();
+  LOG_INFO("bench up %lus gen %lu.%02lu/s rx %lu.%02lu/s sustained %lu.%02lu/s",
+           (unsigned long)((now_ms - bench.started_ms) / 1000), (unsigned long)(generate_rate / 100),
+           (unsigned long)(generate_rate % 100), (unsigned long)(parse_rate / 100), (unsigned long)(parse_rate % 100),
+           (unsigned long)(sustained / 100), (unsigned long)(sustained % 100));
+  LOG_INFO("bench lost %lu skipped %lu overruns %lu", (unsigned long)(bench.frames_generated - rx->frames_ok),
+           (unsigned long)bench.frames_skipped, (unsigned long)rx->overruns);
+  uint32_t average_us = publishes ? (uint32_t)(bench.latency_total_us / publishes) : 0;
+  LOG_INFO("bench pub %lu fail %lu latency avg %lu.%03lu max %lu.%03lu ms", (unsigned long)bench.publishes,
+           (unsigned long)bench.publish_failures, (unsigned long)(average_us / 1000), (unsigned long)(average_us % 1000),
+           (unsigned long)(bench.latency_max_us / 1000), (unsigned long)(bench.latency_max_us % 1000));
+  LOG_INFO("bench heap %lu min %lu block min %lu frag max %u%%", (unsigned long)ESP.getFreeHeap(),
+           (unsigned long)bench.heap_free_min, (unsigned long)bench.heap_max_block_min,
+           (unsigned)bench.heap_fragmentation_max);
+
+  window_started_ms = now_ms;
+  window_generated = bench.frames_generated;
+  window_parsed = rx->frames_ok;
+  window_publishes = bench.publishes;
+  bench.latency_total_us = 0;
+  bench.latency_max_us = 0;
+}
@@ -0,0 +1,297 @@
+#include <telemetry.h>
+#include <config.h>
+
+// Change needed before a field is reported again; 0 reports any change
+static int32_t deadband_temperature = TELEMETRY_DEADBAND_TEMPERATURE;
+static int32_t deadband_humidity = TELEMETRY_DEADBAND_HUMIDITY;
+static int32_t deadband_co2 = TELEMETRY_DEADBAND_CO2;
+static uint32_t keyframe_interval = TELEMETRY_KEYFRAME_INTERVAL;
+
+static int32_t kindDeadband(payload_field_kind kind) {
+  switch (kind) {
+    case FIELD_KIND_TEMPERATURE: return deadband_temperature;
+    case FIELD_KIND_HUMIDITY: return deadband_humidity;
+    case FIELD_KIND_CO2: return deadband_co2;
+    default: return 0;
+  }
+}
+
+// Replaces the compile-time defaults from config.h, e.g. from the device twin
+void telemetry_delta_configure(uint32_t samples_per_keyframe, int32_t temperature, int32_t humidity, int32_t co2) {
+  keyframe_interval = samples_per_keyframe;
+  deadband_temperature = temperature;
+  deadband_humidity = humidity;
+  deadband_co2 = co2;
+}
+
+void telemetry_delta_reset(telemetry_delta_state *state) {
+  state->has_reference = false;
+  state->samples_since_keyframe = 0;
+}
+
+// Picks the fields worth sending for this sample and records them as the
+// new reference. Every keyframe_interval samples, and whenever channels
+// come or go, all fields go out. Returns true for such a keyframe.
+bool telemetry_delta_next_mask(telemetry_delta_state *state, const payload_structure *payload, payload_slot_mask *mask) {
+  bool keyframe = !state->has_reference || state->samples_since_keyframe + 1 >= keyframe_interval
+                  || state->sensor_count != payload->sensor_count || state->fan_count != payload->fan_count;
+  payload_cursor cursor;
+
+  memset(mask, 0, sizeof(*mask));
+  for (bool more = payload_begin(payload, &cursor); more; more = payload_next(payload, &cursor)) {
+    int32_t value = payload_get(payload, &cursor);
+    int32_t delta = value - state->last_reported[cursor.slot];
+    if (delta < 0) {
+      delta = -delta;
+    }
+
+    // Unreported fields keep their old reference so slow drift still
+    // crosses the deadband eventually
+    if (keyframe || delta > kindDeadband(payload_field(&cursor)->kind)) {
+      payload_mask_set(mask, cursor.slot);
+      state->last_reported[cursor.slot] = value;
+    }
+  }
+
+  state->sensor_count = payload->sensor_count;
+  state->fan_count = payload->fan_count;
+  state->samples_since_keyframe = keyframe ? 0 : state->samples_since_keyframe + 1;
+  state->has_reference = true;
+  return keyframe;
+}
+
+// Integer to decimal without going through floats: value is a fixed-point
+// number with `scale` decimals, e.g. 2150 with scale 2 is written as 21.50.
+static az_span writeFixedPoint(az_span out, int32_t value, uint8_t scale) {
+  if (scale == 0) {
+    (void)az_span_i32toa(out, value, &out);
+    return out;
+  }
+
+  int32_t divisor = 1;
+  for (uint8_t i = 0; i < scale; i++) {
+    divisor *= 10;
+  }
+
+  uint32_t magnitude = value < 0 ? (uint32_t)(-(int64_t)value) : (uint32_t)value;
+  if (value < 0) {
+    out = az_span_copy_u8(out, '-');
+  }
+  (void)az_span_u32toa(out, magnitude / divisor, &out);
+  out = az_span_copy_u8(out, '.');
+
+  uint32_t fraction = magnitude % divisor;
+  for (int32_t digit = divisor / 10; digit > 0; digit /= 10) {
+    out = az_span_copy_u8(out, (uint8_t)('0' + (fraction / digit) % 10));
+  }
+  return out;
+}
+
+static_assert(TELEMETRY_SAMPLE_HEADER_MAX_LENGTH + 1 <= TELEMETRY_CHUNK_RESERVE, "sample header exceeds the chunk reserve");
+#define CHECK_RESERVE(max_length, id, name, type, kind, quoted, scale) \
+  static_assert(0 max_length(id, name, type, kind, quoted, scale) <= TELEMETRY_CHUNK_RESERVE, #name " exceeds the chunk reserve");
+#define CHECK_SENSOR_FIELD(...) CHECK_RESERVE(TELEMETRY_SENSOR_FIELD_MAX_LENGTH, __VA_ARGS__)
+#define CHECK_FAN_FIELD(...) CHECK_RESERVE(TELEMETRY_FAN_FIELD_MAX_LENGTH, __VA_ARGS__)
+#define CHECK_CONTROLLER_FIELD(...) CHECK_RESERVE(TELEMETRY_CONTROLLER_FIELD_MAX_LENGTH, __VA_ARGS__)
+SENSOR_CHANNEL_FIELDS(CHECK_SENSOR_FIELD)
+FAN_CHANNEL_FIELDS(CHECK_FAN_FIELD)
+CONTROLLER_FIELDS(CHECK_CONTROLLER_FIELD)
+#undef CHECK_SENSOR_FIELD
+#undef CHECK_FAN_FIELD
+#undef CHECK_CONTROLLER_FIELD
+#undef CHECK_RESERVE
+
+// Message being streamed: bytes are written into stream_chunk and handed to
+// the sink whenever it runs low on room. With a NULL sink only the length
+// is counted.
+typedef struct {
+  az_span free;  // unused part of stream_chunk
+  telemetry_chunk_sink sink;
+  size_t length;
+  bool failed;   // the sink gave up
+} chunk_writer;
+
+static uint8_t stream_chunk[TELEMETRY_CHUNK_LENGTH];
+
+static void flushChunk(chunk_writer *writer) {
+  size_t used = sizeof(stream_chunk) - az_span_size(writer->free);
+
+  writer->length += used;
+  if (used > 0 && writer->sink != NULL && !writer->failed) {
+    writer->failed = !writer->sink(stream_chunk, used);
+  }
+  writer->free = AZ_SPAN_FROM_BUFFER(stream_chunk);
+}
+
+// Room for the next field or header
+static az_span reserve(chunk_writer *writer) {
+  if (az_span_size(writer->free) < TELEMETRY_CHUNK_RESERVE) {
+    flushChunk(writer);
+  }
+  return writer->free;
+}
+
+// `, "<key><suffix>": `
+static az_span writeKey(az_span out, const payload_cursor *cursor, az_span suffix) {
+  out = az_span_copy(out, AZ_SPAN_FROM_STR(", \""));
+  out = payload_write_key(out, cursor);
+  out = az_span_copy(out, suffix);
+  return az_span_copy(out, AZ_SPAN_FROM_STR("\": "));
+}
+
+// Writes the fields selected by mask as a JSON object, one field at a time.
+static void writeSample(chunk_writer *writer, const telemetry_sample *sample, uint32_t sequence,
+                        const payload_slot_mask *mask, bool keyframe) {
+  const payload_structure *payload = &sample->payload;
+  payload_cursor cursor;
+
+  az_span out = reserve(writer);
+  out = az_span_copy(out, AZ_SPAN_FROM_STR("{ \"msgCount\": "));
+  (void)az_span_u32toa(out, sequence, &out);
+
+  // Capture time, so samples drained from the offline queue keep their own time
+  if (sample->timestamp != 0) {
+    out = az_span_copy(out, AZ_SPAN_FROM_STR(", \"ts\": "));
+    (void)az_span_u32toa(out, sample->timestamp, &out);
+  }
+
+  // Frames behind the window; left out for the common single frame case,
+  // where the mean, min and max are all the same value
+  bool summarized = sample->frame_count > 1;
+  if (sample->frame_count != 1) {
+    out = az_span_copy(out, AZ_SPAN_FROM_STR(", \"frames\": "));
+    (void)az_span_u32toa(out, sample->frame_count, &out);
+  }
+  writer->free = out;
+
+  for (bool more = payload_begin(payload, &cursor); more; more = payload_next(payload, &cursor)) {
+    if (!payload_mask_test(mask, cursor.slot)) {
+      continue;
+    }
+    const payload_field_info *info = payload_field(&cursor);
+
+    out = writeKey(reserve(writer), &cursor, AZ_SPAN_EMPTY);
+    if (info->quoted) {
+      out = az_span_copy_u8(out, '"');
+    }
+    out = writeFixedPoint(out, payload_get(payload, &cursor), info->scale);
+    if (info->quoted) {
+      out = az_span_copy_u8(out, '"');
+    }
+    if (summarized && PAYLOAD_KIND_IS_MEASUREMENT(info->kind)) {
+      out = writeKey(out, &cursor, AZ_SPAN_FROM_STR("_min"));
+      out = writeFixedPoint(out, payload_get(&sample->payload_min, &cursor), info->scale);
+      out = writeKey(out, &cursor, AZ_SPAN_FROM_STR("_max"));
+      out = writeFixedPoint(out, payload_get(&sample->payload_max, &cursor), info->scale);
+    }
+    writer->free = out;
+  }
+
+  out = reserve(writer);
+  if (keyframe) {
+    out = az_span_copy(out, AZ_SPAN_FROM_STR(", \"keyframe\": true"));
+  }
+  writer->free = az_span_copy(out, AZ_SPAN_FROM_STR(" }"));
+}
+
+// Serializes up to max_samples samples, as a JSON array when more than one
+// is allowed, advancing delta as it goes, through the small static chunk
+// buffer. With a NULL sink only the length is computed; run it again from
+// the same delta state to send what was measured.
+// Returns the number of samples written and their total length in *length,
+// or 0 if the sink gave up.
+size_t telemetry_stream_batch(telemetry_sample_source source, size_t max_samples, uint32_t first_sequence,
+                              telemetry_delta_state *delta, telemetry_chunk_sink sink, size_t *length) {
+  chunk_writer writer = { AZ_SPAN_FROM_BUFFER(stream_chunk), sink, 0, false };
+  telemetry_sample sample;
+  payload_slot_mask mask;
+  size_t count = 0;
+
+  if (max_samples > 1) {
+    writer.free = az_span_copy_u8(writer.free, '[');
+  }
+  while (!writer.failed && count < max_samples && source(count, &sample)) {
+    if (count > 0) {
+      writer.free = az_span_copy_u8(reserve(&writer), ',');
+    }
+    bool keyframe = telemetry_delta_next_mask(delta, &sample.payload, &mask);
+    writeSample(&writer, &sample, first_sequence + count, &mask, keyframe);
+    count++;
+  }
+  if (max_samples > 1) {
+    writer.free = az_span_copy_u8(reserve(&writer), ']');
+  }
+  flushChunk(&writer);
+
+  *length = writer.length;
+  return writer.failed ? 0 : count;
+}
+
+// Longest varint of a 32 bit value
+#define VARINT_MAX_LENGTH 5
+
+static_assert(3 * VARINT_MAX_LENGTH <= TELEMETRY_CHUNK_RESERVE && 1 + 2 * VARINT_MAX_LENGTH + 2 <= TELEMETRY_CHUNK_RESERVE,
+              "packed field exceeds the chunk reserve");
+
+static az_span writeVarint(az_span out, uint32_t value) {
+  while (value >= 0x80) {
+    out = az_span_copy_u8(out, (uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  return az_span_copy_u8(out, (uint8_t)value);
+}
+
+static az_span writeZigzag(az_span out, int32_t value) {
+  return writeVarint(out, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+// Previous sample of the packed message being written
+static payload_structure packed_previous;
+
+static void writePackedSample(chunk_writer *writer, const telemetry_sample *sample, uint32_t previous_timestamp,
+                              bool first) {
+  const payload_structure *payload = &sample->payload;
+  bool absolute = first || !payload_same_channels(payload, &packed_previous);
+  bool summarized = sample->frame_count > 1;
+  payload_cursor cursor;
+
+  az_span out = reserve(writer);
+  out = writeZigzag(out, (int32_t)(sample->timestamp - previous_timestamp));
+  out = writeVarint(out, sample->frame_count);
+  out = az_span_copy_u8(out, payload->sensor_count);
+  writer->free = az_span_copy_u8(out, payload->fan_count);
+
+  for (bool more = payload_begin(payload, &cursor); more; more = payload_next(payload, &cursor)) {
+    int32_t value = payload_get(payload, &cursor);
+
+    out = writeZigzag(reserve(writer), absolute ? value : value - payload_get(&packed_previous, &cursor));
+    if (summarized && PAYLOAD_KIND_IS_MEASUREMENT(payload_field(&cursor)->kind)) {
+      out = writeZigzag(out, payload_get(&sample->payload_min, &cursor) - value);
+      out = writeZigzag(out, payload_get(&sample->payload_max, &cursor) - value);
+    }
+    writer->free = out;
+  }
+  packed_previous = *payload;
+}
+
+// Same contract as telemetry_stream_batch(), in the packed encoding. Every
+// message stands on its own, so there is no delta state to carry.
+size_t telemetry_stream_packed(telemetry_sample_source source, size_t max_samples, uint32_t first_sequence,
+                               telemetry_chunk_sink sink, size_t *length) {
+  chunk_writer writer = { AZ_SPAN_FROM_BUFFER(stream_chunk), sink, 0, false };
+  telemetry_sample sample;
+  uint32_t previous_timestamp = 0;
+  size_t count = 0;
+
+  writer.free = az_span_copy_u8(writer.free, TELEMETRY_PACKED_VERSION);
+  writer.free = writeVarint(writer.free, first_sequence);
+  while (!writer.failed && count < max_samples && source(count, &sample)) {
+    writePackedSample(&writer, &sample, previous_timestamp, count == 0);
+    previous_timestamp = sample.timestamp;
+    count++;
+  }
+  flushChunk(&writer);
+
+  *length = writer.length;
+  return writer.failed ? 0 : count;
+}
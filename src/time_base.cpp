@@ -0,0 +1,91 @@
+#include <time_base.h>
+
+#include <coredecls.h>
+#include <sys/time.h>
+#include <time.h>
+
+static time_base_rtc state;
+static bool estimated = false;        // set from the saved estimate, not by SNTP yet
+static uint64_t restored_epoch_ms = 0;
+static uint32_t restored_at_ms = 0;   // millis() when it was set
+
+static uint64_t clockMs() {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// SNTP answered. After a restored estimate the difference to it is the
+// error of the sleep timer over the sleep since the previous sync.
+static void clockSet(bool from_sntp) {
+  if (!from_sntp) {
+    return;
+  }
+
+  if (estimated && state.slept_ms >= TIME_BASE_MIN_DRIFT_WINDOW_MS) {
+    int64_t expected_ms = (int64_t)(restored_epoch_ms + (uint32_t)(millis() - restored_at_ms));
+    int64_t error_ms = (int64_t)clockMs() - expected_ms;
+    int64_t ppm = state.sleep_ppm + error_ms * 1000000 / (int64_t)state.slept_ms;
+
+    if (ppm > TIME_BASE_MAX_SLEEP_PPM) {
+      ppm = TIME_BASE_MAX_SLEEP_PPM;
+    } else if (ppm < -TIME_BASE_MAX_SLEEP_PPM) {
+      ppm = -TIME_BASE_MAX_SLEEP_PPM;
+    }
+    state.sleep_ppm = (int32_t)ppm;
+  }
+  state.slept_ms = 0;
+  estimated = false;
+}
+
+void time_base_begin() {
+  settimeofday_cb(clockSet);
+}
+
+// Sets the clock from the estimate saved before the sleep, if there is one.
+void time_base_restore(const time_base_rtc *saved) {
+  state = *saved;
+  if (state.seconds == 0) {
+    return;
+  }
+
+  restored_at_ms = millis();
+  restored_epoch_ms = (uint64_t)state.seconds * 1000 + state.milliseconds + restored_at_ms;
+  struct timeval now = { (time_t)(restored_epoch_ms / 1000), (suseconds_t)(restored_epoch_ms % 1000) * 1000 };
+  settimeofday(&now, NULL);
+  estimated = true;
+}
+
+// Saves the clock as it should read after sleep_ms into saved and returns
+// the sleep to ask the timer for.
+uint32_t time_base_prepare_sleep(time_base_rtc *saved, uint32_t sleep_ms) {
+  if (time_base_valid()) {
+    uint64_t wake_ms = clockMs() + sleep_ms;
+    state.seconds = (uint32_t)(wake_ms / 1000);
+    state.milliseconds = (uint32_t)(wake_ms % 1000);
+  } else {
+    state.seconds = 0;
+    state.milliseconds = 0;
+  }
+  state.slept_ms = state.slept_ms + sleep_ms > state.slept_ms ? state.slept_ms + sleep_ms : UINT32_MAX;
+  *saved = state;
+  return (uint32_t)((uint64_t)sleep_ms * 1000000 / (1000000 + state.sleep_ppm));
+}
+
+bool time_base_valid() {
+  return time(NULL) >= TIME_BASE_MIN_VALID_EPOCH_SECS;
+}
+
+// true while the clock is the estimate carried over a sleep
+bool time_base_estimated() {
+  return estimated;
+}
+
+// Seconds since epoch, 0 while the clock is not set
+uint32_t time_base_now() {
+  return time_base_valid() ? (uint32_t)time(NULL) : 0;
+}
+
+int32_t time_base_sleep_ppm() {
+  return state.sleep_ppm;
+}
@@ -0,0 +1,64 @@
+#include <wifi_cache.h>
+
+#include <serial_protocol.h>
+#include <stddef.h>
+
+#define WIFI_CACHE_MAGIC 0x32434657  // "WFC2"
+
+typedef struct {
+  uint32_t magic;
+  uint16_t crc;        // CRC16 of everything after it
+  uint16_t ssid_crc;   // the lease only holds for the network it came from
+  uint16_t uses;       // cached joins since the last DHCP one
+  uint16_t reserved;
+  wifi_lease lease;
+} rtc_wifi_image;
+
+static_assert(sizeof(rtc_wifi_image) % 4 == 0, "RTC memory is written in 4 byte blocks");
+static_assert(WIFI_CACHE_RTC_OFFSET * 4 + sizeof(rtc_wifi_image) <= 512, "WiFi cache exceeds the RTC user memory");
+
+static uint16_t imageCrc(const rtc_wifi_image *image) {
+  size_t start = offsetof(rtc_wifi_image, ssid_crc);
+  return crc16_ccitt((const uint8_t *)image + start, sizeof(*image) - start);
+}
+
+static uint16_t ssidCrc(const char *ssid) {
+  return crc16_ccitt((const uint8_t *)ssid, strlen(ssid));
+}
+
+// false if nothing valid is cached for ssid, or it was used up; every
+// successful load counts as one use
+bool wifi_cache_load(const char *ssid, wifi_lease *lease) {
+  rtc_wifi_image image;
+
+  if (!ESP.rtcUserMemoryRead(WIFI_CACHE_RTC_OFFSET, (uint32_t *)&image, sizeof(image))
+      || image.magic != WIFI_CACHE_MAGIC || image.crc != imageCrc(&image) || image.ssid_crc != ssidCrc(ssid)
+      || image.lease.channel == 0 || image.lease.ip == 0) {
+    return false;
+  }
+  if (image.uses >= WIFI_CACHE_MAX_USES) {
+    wifi_cache_clear();
+    return false;
+  }
+  image.uses++;
+  image.crc = imageCrc(&image);
+  ESP.rtcUserMemoryWrite(WIFI_CACHE_RTC_OFFSET, (uint32_t *)&image, sizeof(image));
+  *lease = image.lease;
+  return true;
+}
+
+void wifi_cache_save(const char *ssid, const wifi_lease *lease) {
+  rtc_wifi_image image;
+
+  memset(&image, 0, sizeof(image));
+  image.magic = WIFI_CACHE_MAGIC;
+  image.ssid_crc = ssidCrc(ssid);
+  image.lease = *lease;
+  image.crc = imageCrc(&image);
+  ESP.rtcUserMemoryWrite(WIFI_CACHE_RTC_OFFSET, (uint32_t *)&image, sizeof(image));
+}
+
+void wifi_cache_clear() {
+  uint32_t magic = 0;
+  ESP.rtcUserMemoryWrite(WIFI_CACHE_RTC_OFFSET, &magic, sizeof(magic));
+}